@@ -71,15 +71,47 @@ static void rdma_release_resources();
 static int rdma_build_single();
 static int rdma_build(int port, enum rdma_transport transport, FILE *portnumber_file);
 static void rdma_cm_event_handler(int fd, short libevent_event, void *arg);
+static void rdma_async_event_handler(int fd, short libevent_event, void *arg);
+static void rdma_qp_failed(struct ibv_qp *qp);
+static void rdma_conn_fail(conn *c);
+static bool rdma_end_implied(conn *c);
 static int attach_rdma_listen_event();
-static int handle_connect_request(struct rdma_cm_id *id);
+static void handle_connect_request(struct rdma_cm_event *cm_event);
 
 static void rdma_drive_machine(struct ibv_wc *wc, conn* c);
-static int rdma_add_sge(conn *c, const void *buf, int len);
-
-static conn* rdma_conn_new();
+static int rdma_add_sge(conn *c, const void *buf, int len, bool in_place);
+static int rdma_append_sge(conn *c, const void *buf, int len, bool in_place);
+static int rdma_release_send_bufs(conn *c);
+static int rdma_post_response(conn *c, bool signal);
+static void rdma_release_unsent(conn *c);
+static void rdma_reclaim_sends(conn *c, uint32_t seq);
+static bool rdma_send_blocked(conn *c);
+static bool rdma_send_queue_full(conn *c);
+static int rdma_parse_ctrl_hdr(conn *c);
+static int rdma_stash_recv(conn *c, struct ibv_mr *mr, uint32_t len);
+static void rdma_conn_destroy(conn *c);
+static void rdma_conn_shrink(conn *c);
+static bool rdma_next_recv(conn *c);
+static int rdma_repost_recv(conn *c);
+static bool rdma_recv_class_owns(rdma_recv_class_t *cls, struct ibv_mr *mr);
+static int rdma_queue_recv(conn *c, struct ibv_mr *mr);
+static int rdma_requeue_recv(LIBEVENT_THREAD *me, rdma_recv_class_t *cls, struct ibv_mr *mr);
+static void rdma_reclaim_stray_recv(LIBEVENT_THREAD *me, struct ibv_mr *mr);
+static int rdma_post_recv_now(conn *c, struct ibv_mr *mr);
+static bool rdma_can_batch(conn *c);
+static uint64_t rdma_spin_budget(LIBEVENT_THREAD *me);
+static int rdma_poll_cq(LIBEVENT_THREAD *me);
+static void rdma_rindex_publish(item *it, const uint32_t hv);
+static void rdma_rindex_retract(const uint32_t hv);
+static bool rdma_counter_claim(item *it, const uint32_t hv, uint32_t *slot);
+static uint32_t rdma_counter_slot(item *it);
+static uint64_t rdma_counter_add(item *it, const bool incr, const uint64_t delta);
+static int rdma_counter_add_iov(conn *c, item *it, int *si, const int len);
+
+static conn* rdma_conn_new(LIBEVENT_THREAD *thread);
 static void rdma_conn_cleanup(conn *c); 
 static void rdma_conn_free(conn *c);
+static void rdma_conn_abort(conn *c);
 
 /*
  * forward declarations
@@ -120,6 +152,7 @@ static void process_command(conn *c, char *command);
 static void write_and_free(conn *c, char *buf, int bytes);
 static int ensure_iov_space(conn *c);
 static int add_iov(conn *c, const void *buf, int len);
+static int add_item_iov(conn *c, const void *buf, int len);
 static int add_msghdr(conn *c);
 static void write_bin_error(conn *c, protocol_binary_response_status err,
                             const char *errstr, int swallow);
@@ -202,6 +235,12 @@ static void stats_init(void) {
     stats.get_cmds = stats.set_cmds = stats.get_hits = stats.get_misses = stats.evictions = stats.reclaimed = 0;
     stats.touch_cmds = stats.touch_misses = stats.touch_hits = stats.rejected_conns = 0;
     stats.malloc_fails = 0;
+    stats.rdma_conns_reused = 0;
+    stats.rdma_conns_shed = 0;
+    stats.rdma_ud_clients = 0;
+    stats.rdma_qp_error_events = stats.rdma_cq_error_events = stats.rdma_srq_error_events = 0;
+    stats.rdma_port_events = stats.rdma_device_fatal_events = stats.rdma_other_events = 0;
+    stats.rdma_error_completions = stats.rdma_ud_qp_resets = 0;
     stats.curr_bytes = stats.listen_disabled_num = 0;
     stats.hash_power_level = stats.hash_bytes = stats.hash_is_expanding = 0;
     stats.expired_unfetched = stats.evicted_unfetched = 0;
@@ -225,6 +264,12 @@ static void stats_reset(void) {
     stats.total_items = stats.total_conns = 0;
     stats.rejected_conns = 0;
     stats.malloc_fails = 0;
+    stats.rdma_conns_reused = 0;
+    stats.rdma_conns_shed = 0;
+    stats.rdma_ud_clients = 0;
+    stats.rdma_qp_error_events = stats.rdma_cq_error_events = stats.rdma_srq_error_events = 0;
+    stats.rdma_port_events = stats.rdma_device_fatal_events = stats.rdma_other_events = 0;
+    stats.rdma_error_completions = stats.rdma_ud_qp_resets = 0;
     stats.evictions = 0;
     stats.reclaimed = 0;
     stats.listen_disabled_num = 0;
@@ -276,11 +321,35 @@ static void settings_init(void) {
 
     rdma_context.srq_size = 1024;
     rdma_context.cq_size = 1024;
-    rdma_context.buff_per_thread = 128;
+    rdma_context.buff_per_thread = 8;
     rdma_context.buff_size = 1024 * 1024;
+    rdma_context.recv_small_count = 1024;
+    rdma_context.recv_small_size = 4096;
+    rdma_context.recv_growth = 4;
+    rdma_context.inline_size = 128;
     rdma_context.poll_wc_size = 128 + 5;
     rdma_context.ack_events = 16;
-    rdma_context.device_index = 0;
+    rdma_context.device_mask = 1;
+    rdma_context.send_pool_size = 1024 * 1024;
+    rdma_context.send_arena_size = 8 * 1024 * 1024;
+    rdma_context.arena_mr = false;
+    rdma_context.zero_copy_min = 4096;
+    rdma_context.rindex = NULL;
+    rdma_context.rindex_data = NULL;
+    rdma_context.rindex_power = 0;
+    rdma_context.counters = NULL;
+    rdma_context.counter_owners = NULL;
+    rdma_context.counters_power = 0;
+    rdma_context.counters_local = true;
+    rdma_context.signal_interval = 16;
+    rdma_context.poll_mode = RDMA_POLL_EVENT;
+    rdma_context.spin_usec = 50;
+    rdma_context.placement = RDMA_PLACE_LOAD;
+    rdma_context.rebalance_secs = 0;
+    rdma_context.ud_count = 0;
+    rdma_context.credits = 32;
+    rdma_context.qp_pool = 16;
+    rdma_context.conn_pool_max = 64;
 }
 
 /*
@@ -751,56 +820,217 @@ static int ensure_iov_space(conn *c) {
     return 0;
 }
 
+/*
+ * Makes room for one more fragment in the send lists. They start small and
+ * double on demand, so only connections that send large multigets pay for
+ * long lists; rdma_conn_shrink() gives the memory back once they go idle.
+ *
+ * Returns 0 on success, -1 on out-of-memory.
+ */
+static int
+rdma_ensure_send_space(conn *c) {
+    /* past this a response would not fit the send queue */
+    if (c->sge_used == RDMA_SEND_MAX_SGE) {
+        return -1;
+    }
+    if (c->sge_used == c->sge_size) {
+        struct ibv_sge *new_sge = realloc(c->sge, c->sge_size * 2 * sizeof(c->sge[0]));
+        if (!new_sge)
+            return -1;
+        c->sge = new_sge;
+        c->sge_size *= 2;
+    }
+    if (c->sbuf_used == c->sbuf_size) {
+        rdma_sbuf_t **new_list = realloc(c->sbuf_list, c->sbuf_size * 2 * sizeof(c->sbuf_list[0]));
+        if (!new_list)
+            return -1;
+        c->sbuf_list = new_list;
+        c->sbuf_size *= 2;
+    }
+    if (c->wmr_used == c->wmr_size) {
+        struct ibv_mr **new_list = realloc(c->wmr_list, c->wmr_size * 2 * sizeof(c->wmr_list[0]));
+        if (!new_list)
+            return -1;
+        c->wmr_list = new_list;
+        c->wmr_size *= 2;
+    }
+    return 0;
+}
+
+/*
+ * Makes sure the conn's filling arena chunk has len bytes left, taking a
+ * fresh chunk from the worker's send arena if needed.
+ *
+ * Returns 0 on success, -1 if the conn holds all the chunks it may or the
+ * arena is exhausted; the caller then falls back to the send pool.
+ */
+static int
+rdma_arena_reserve(conn *c, int len) {
+    if (c->achunk_used > 0 && c->aused + len <= RDMA_ARENA_CHUNK) {
+        return 0;
+    }
+    if (c->achunk_used == RDMA_ARENA_CONN_CHUNKS) {
+        return -1;
+    }
+
+    rdma_sbuf_t *chunk = rdma_send_arena_get(c->thread);
+    if (!chunk) {
+        pthread_mutex_lock(&c->thread->stats.mutex);
+        c->thread->stats.rdma_arena_stalls++;
+        pthread_mutex_unlock(&c->thread->stats.mutex);
+        return -1;
+    }
+
+    c->achunks[c->achunk_used] = chunk;
+    c->achunk_used += 1;
+    c->aused = 0;
+    return 0;
+}
+
 /***************************************************************************//**
  * RDMA Part: adds data to the sge that will be posted to the connection
  *
  ******************************************************************************/
 static int 
-rdma_add_sge(conn *c, const void *buf, int len) {
+rdma_add_sge(conn *c, const void *buf, int len, bool in_place) {
     assert(c->sge_used < IOV_MAX);
 
     if (settings.verbose > 2) {
         fprintf(stderr, "debug print, buf: %s, sge num: %d\n", (char*)buf, c->sge_used);
     }
 
-    if (0 == strncmp("END\r\n", buf, 5 < len ? 5 : len)) {
-        return 0;
+    return rdma_append_sge(c, buf, len, in_place);
+}
+
+/*
+ * Whether a GET leaves out its "END\r\n": when the receive held only this
+ * command, the completion marks the end of the response. A receive with
+ * several commands, counted as they run, keeps text protocol framing.
+ * The reply is flagged so a chained SEND puts the terminator back.
+ */
+static bool
+rdma_end_implied(conn *c) {
+    if (c->recv_cmds > 0 || c->rcont < c->rcurr + c->rbytes) {
+        return false;
+    }
+    c->end_dropped = true;
+    return true;
+}
+
+/*
+ * in_place is only set for item memory whose reference the response holds
+ * until its send completes; anything else is copied or registered.
+ */
+static int
+rdma_append_sge(conn *c, const void *buf, int len, bool in_place) {
+    if (rdma_ensure_send_space(c) != 0) {
+        return -1;
     }
 
-    if (c->wused + len <= c->wsize) {
-        memmove(c->wbuf + c->wused, buf, len);
-        c->wused += len;
+    if (len <= RDMA_ARENA_CHUNK && 0 == rdma_arena_reserve(c, len)) {
+        struct ibv_sge *last = c->sge_used > 0 ? &c->sge[c->sge_used - 1] : NULL;
+        rdma_sbuf_t *chunk = c->achunks[c->achunk_used - 1];
+        char *dst = chunk->buf + c->aused;
+
+        memcpy(dst, buf, len);
 
-        c->sge[0].length = c->wused;
-        if (0 == c->sge_used) {
-            c->sge[0].addr = (uintptr_t)c->wbuf;
-            c->sge[0].lkey = c->wmr->lkey;
+        /* extend the tail segment if it ends where this copy starts */
+        if (last && last->addr + last->length == (uintptr_t)dst) {
+            last->length += len;
+        } else {
+            c->sge[c->sge_used].addr = (uintptr_t)dst;
+            c->sge[c->sge_used].length = len;
+            c->sge[c->sge_used].lkey = chunk->lkey;
             c->sge_used += 1;
         }
+        c->aused += len;
 
     } else {
-        if (c->wmr_used == c->sge_size) {
-            perror("need more sge!\n");
-            return -1;
+        /* large item values are sent in place when item memory is registered */
+        if (in_place && c->thread->arena_mr && len >= rdma_context.zero_copy_min) {
+            c->sge[c->sge_used].addr = (uintptr_t)buf;
+            c->sge[c->sge_used].length = len;
+            c->sge[c->sge_used].lkey = c->thread->arena_mr->lkey;
+            c->sge_used += 1;
+
+            pthread_mutex_lock(&c->thread->stats.mutex);
+            c->thread->stats.rdma_zero_copy++;
+            pthread_mutex_unlock(&c->thread->stats.mutex);
+            return 0;
+        }
+
+        /* stage the fragment in a pre-registered chunk if one is free */
+        rdma_sbuf_t *sbuf = rdma_send_pool_get(c->thread, len);
+        if (sbuf) {
+            memcpy(sbuf->buf, buf, len);
+            c->sge[c->sge_used].addr = (uintptr_t)sbuf->buf;
+            c->sge[c->sge_used].length = len;
+            c->sge[c->sge_used].lkey = sbuf->lkey;
+            c->sge_used += 1;
+
+            c->sbuf_list[c->sbuf_used] = sbuf;
+            c->sbuf_used += 1;
+
+            pthread_mutex_lock(&c->thread->stats.mutex);
+            c->thread->stats.rdma_pool_hits++;
+            pthread_mutex_unlock(&c->thread->stats.mutex);
+            return 0;
         }
 
-        struct ibv_mr *mr = rdma_reg_msgs(c->id, (void*)buf, len);
+        struct ibv_mr *mr = ibv_reg_mr(c->pd, (void*)buf, len, IBV_ACCESS_LOCAL_WRITE);
         if (!mr) {
-            perror("in rdma_add_sge(), rdma_reg_msgs()");
+            perror("in rdma_add_sge(), ibv_reg_mr()");
             return -1;
         }
         c->sge[c->sge_used].addr = (uintptr_t)buf;
         c->sge[c->sge_used].length = len;
-        c->sge[c->sge_used].lkey = mr->lkey; /* RDMA TODO 1 */
+        c->sge[c->sge_used].lkey = mr->lkey;
         c->sge_used += 1;
 
         c->wmr_list[c->wmr_used] = mr;
         c->wmr_used += 1;
+
+        pthread_mutex_lock(&c->thread->stats.mutex);
+        c->thread->stats.rdma_pool_misses++;
+        c->thread->stats.rdma_reg_calls++;
+        pthread_mutex_unlock(&c->thread->stats.mutex);
     }
 
     return 0;
 }
 
+/*
+ * Returns the send buffers of a finished response: arena and pool chunks go
+ * back to the thread, ad-hoc registrations are dropped.
+ *
+ * Returns 0 on success, -1 if a memory region could not be deregistered.
+ */
+static int
+rdma_release_send_bufs(conn *c) {
+    int i = 0, ret = 0;
+
+    for (i = 0; i < c->achunk_used; ++i) {
+        rdma_send_arena_put(c->thread, c->achunks[i]);
+    }
+    c->achunk_used = 0;
+    c->aused = 0;
+
+    for (i = 0; i < c->sbuf_used; ++i) {
+        rdma_send_pool_put(c->thread, c->sbuf_list[i]);
+    }
+    c->sbuf_used = 0;
+
+    for (i = 0; i < c->wmr_used; ++i) {
+        if (0 != rdma_dereg_mr(c->wmr_list[i])) {
+            perror("rdma_dereg_mr()");
+            ret = -1;
+        }
+    }
+    c->wmr_used = 0;
+
+    return ret;
+}
+
 /*
  * Adds data to the list of pending data that will be written out to a
  * connection.
@@ -810,7 +1040,7 @@ rdma_add_sge(conn *c, const void *buf, int len) {
 
 static int add_iov(conn *c, const void *buf, int len) {
     /* Hook! */
-    return rdma_add_sge(c, buf, len);
+    return rdma_add_sge(c, buf, len, false);
     
     struct msghdr *m;
     int leftover;
@@ -860,6 +1090,14 @@ static int add_iov(conn *c, const void *buf, int len) {
     return 0;
 }
 
+/*
+ * Like add_iov(), for the value of an item the response holds a reference
+ * to (c->item or the ilist), so a large value may be sent without a copy.
+ */
+static int add_item_iov(conn *c, const void *buf, int len) {
+    return rdma_add_sge(c, buf, len, true);
+}
+
 
 /*
  * Constructs a set of UDP headers and attaches them to the outgoing messages.
@@ -1278,6 +1516,10 @@ static void complete_incr_bin(conn *c) {
     case DELTA_ITEM_CAS_MISMATCH:
         write_bin_error(c, PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS, NULL, 0);
         break;
+    case DELTA_ITEM_REMOTE_ONLY:
+        write_bin_error(c, PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED,
+                        "Counter is only updated remotely", 0);
+        break;
     }
 }
 
@@ -1423,7 +1665,14 @@ static void process_bin_get_or_touch(conn *c) {
 
         if (should_return_value) {
             /* Add the data minus the CRLF */
-            add_iov(c, ITEM_data(it), it->nbytes - 2);
+            if (it->it_flags & ITEM_COUNTER) {
+                int si = c->suffixleft;
+                rdma_counter_add_iov(c, it, &si, it->nbytes - 2);
+                c->suffixcurr = c->suffixlist;
+                c->suffixleft = si;
+            } else {
+                add_item_iov(c, ITEM_data(it), it->nbytes - 2);
+            }
         }
 
         conn_set_state(c, conn_mwrite);
@@ -2399,6 +2648,10 @@ enum store_item_type do_store_item(item *it, int comm, conn *c, const uint32_t h
         || comm == NREAD_APPEND || comm == NREAD_PREPEND))
     {
         /* replace only replaces an existing value; don't store */
+    } else if ((comm == NREAD_APPEND || comm == NREAD_PREPEND)
+        && (old_it->it_flags & ITEM_COUNTER))
+    {
+        /* a counter's value is not in the item; don't store */
     } else if (comm == NREAD_CAS) {
         /* validate cas operation */
         if(old_it == NULL) {
@@ -2496,6 +2749,7 @@ enum store_item_type do_store_item(item *it, int comm, conn *c, const uint32_t h
 
     if (stored == STORED) {
         c->cas = ITEM_get_cas(it);
+        rdma_rindex_publish(it, hv);
     }
 
     return stored;
@@ -2682,6 +2936,17 @@ static void server_stats(ADD_STAT add_stats, conn *c) {
         APPEND_STAT("rejected_connections", "%llu", (unsigned long long)stats.rejected_conns);
     }
     APPEND_STAT("connection_structures", "%u", stats.conn_structs);
+    APPEND_STAT("rdma_conns_reused", "%llu", (unsigned long long)stats.rdma_conns_reused);
+    APPEND_STAT("rdma_conns_shed", "%llu", (unsigned long long)stats.rdma_conns_shed);
+    APPEND_STAT("rdma_ud_clients", "%llu", (unsigned long long)stats.rdma_ud_clients);
+    APPEND_STAT("rdma_qp_error_events", "%llu", (unsigned long long)stats.rdma_qp_error_events);
+    APPEND_STAT("rdma_cq_error_events", "%llu", (unsigned long long)stats.rdma_cq_error_events);
+    APPEND_STAT("rdma_srq_error_events", "%llu", (unsigned long long)stats.rdma_srq_error_events);
+    APPEND_STAT("rdma_port_events", "%llu", (unsigned long long)stats.rdma_port_events);
+    APPEND_STAT("rdma_device_fatal_events", "%llu", (unsigned long long)stats.rdma_device_fatal_events);
+    APPEND_STAT("rdma_other_events", "%llu", (unsigned long long)stats.rdma_other_events);
+    APPEND_STAT("rdma_error_completions", "%llu", (unsigned long long)stats.rdma_error_completions);
+    APPEND_STAT("rdma_ud_qp_resets", "%llu", (unsigned long long)stats.rdma_ud_qp_resets);
     APPEND_STAT("reserved_fds", "%u", stats.reserved_fds);
     APPEND_STAT("cmd_get", "%llu", (unsigned long long)thread_stats.get_cmds);
     APPEND_STAT("cmd_set", "%llu", (unsigned long long)slab_stats.set_cmds);
@@ -2704,6 +2969,72 @@ static void server_stats(ADD_STAT add_stats, conn *c) {
     APPEND_STAT("auth_errors", "%llu", (unsigned long long)thread_stats.auth_errors);
     APPEND_STAT("bytes_read", "%llu", (unsigned long long)thread_stats.bytes_read);
     APPEND_STAT("bytes_written", "%llu", (unsigned long long)thread_stats.bytes_written);
+    APPEND_STAT("rdma_pool_hits", "%llu", (unsigned long long)thread_stats.rdma_pool_hits);
+    APPEND_STAT("rdma_pool_misses", "%llu", (unsigned long long)thread_stats.rdma_pool_misses);
+    APPEND_STAT("rdma_reg_calls", "%llu", (unsigned long long)thread_stats.rdma_reg_calls);
+    APPEND_STAT("rdma_send_arena_chunks", "%llu", (unsigned long long)thread_stats.rdma_arena_chunks);
+    APPEND_STAT("rdma_send_arena_used", "%llu", (unsigned long long)thread_stats.rdma_arena_used);
+    APPEND_STAT("rdma_send_arena_stalls", "%llu", (unsigned long long)thread_stats.rdma_arena_stalls);
+    if (rdma_context.recv_small_count > 0) {
+        APPEND_STAT("rdma_recv_small_buffers", "%llu",
+                    (unsigned long long)thread_stats.rdma_recv_buffers[RDMA_RECV_SMALL]);
+        APPEND_STAT("rdma_recv_small_posted", "%llu",
+                    (unsigned long long)thread_stats.rdma_recv_posted[RDMA_RECV_SMALL]);
+    }
+    if (rdma_context.buff_per_thread > 0) {
+        APPEND_STAT("rdma_recv_large_buffers", "%llu",
+                    (unsigned long long)thread_stats.rdma_recv_buffers[RDMA_RECV_LARGE]);
+        APPEND_STAT("rdma_recv_large_posted", "%llu",
+                    (unsigned long long)thread_stats.rdma_recv_posted[RDMA_RECV_LARGE]);
+    }
+    if (rdma_context.ud_count > 0) {
+        APPEND_STAT("rdma_recv_ud_buffers", "%llu",
+                    (unsigned long long)thread_stats.rdma_recv_buffers[RDMA_RECV_UD]);
+        APPEND_STAT("rdma_recv_ud_posted", "%llu",
+                    (unsigned long long)thread_stats.rdma_recv_posted[RDMA_RECV_UD]);
+        APPEND_STAT("rdma_ud_recvs", "%llu", (unsigned long long)thread_stats.rdma_ud_recvs);
+        APPEND_STAT("rdma_ud_sends", "%llu", (unsigned long long)thread_stats.rdma_ud_sends);
+        APPEND_STAT("rdma_ud_drops", "%llu", (unsigned long long)thread_stats.rdma_ud_drops);
+    }
+    if (rdma_context.credits > 0) {
+        APPEND_STAT("rdma_credit_updates", "%llu", (unsigned long long)thread_stats.rdma_credit_updates);
+        APPEND_STAT("rdma_credit_short", "%llu", (unsigned long long)thread_stats.rdma_credit_short);
+        APPEND_STAT("rdma_credit_overruns", "%llu", (unsigned long long)thread_stats.rdma_credit_overruns);
+    }
+    if (rdma_context.counters) {
+        APPEND_STAT("rdma_counter_creates", "%llu", (unsigned long long)thread_stats.rdma_counter_creates);
+        APPEND_STAT("rdma_counter_full", "%llu", (unsigned long long)thread_stats.rdma_counter_full);
+    }
+    APPEND_STAT("rdma_srq_limit_events", "%llu", (unsigned long long)thread_stats.rdma_srq_limit_events);
+    APPEND_STAT("rdma_srq_grown", "%llu", (unsigned long long)thread_stats.rdma_srq_grown);
+    APPEND_STAT("rdma_srq_capped", "%llu", (unsigned long long)thread_stats.rdma_srq_capped);
+    APPEND_STAT("rdma_srq_empty", "%llu", (unsigned long long)thread_stats.rdma_srq_empty);
+    APPEND_STAT("rdma_qp_pool_hits", "%llu", (unsigned long long)thread_stats.rdma_qp_pool_hits);
+    APPEND_STAT("rdma_qp_pool_misses", "%llu", (unsigned long long)thread_stats.rdma_qp_pool_misses);
+    APPEND_STAT("rdma_connect_p50_usec", "%llu",
+                (unsigned long long)rdma_connect_percentile(&thread_stats, 0.5));
+    APPEND_STAT("rdma_connect_p90_usec", "%llu",
+                (unsigned long long)rdma_connect_percentile(&thread_stats, 0.9));
+    APPEND_STAT("rdma_connect_p99_usec", "%llu",
+                (unsigned long long)rdma_connect_percentile(&thread_stats, 0.99));
+    APPEND_STAT("rdma_connect_p999_usec", "%llu",
+                (unsigned long long)rdma_connect_percentile(&thread_stats, 0.999));
+    APPEND_STAT("rdma_cmds", "%llu", (unsigned long long)thread_stats.rdma_cmds);
+    APPEND_STAT("rdma_cqes", "%llu", (unsigned long long)thread_stats.rdma_cqes);
+    APPEND_STAT("rdma_sends", "%llu", (unsigned long long)thread_stats.rdma_sends);
+    APPEND_STAT("rdma_send_cqes", "%llu", (unsigned long long)thread_stats.rdma_send_cqes);
+    APPEND_STAT("rdma_inline_sends", "%llu", (unsigned long long)thread_stats.rdma_inline_sends);
+    APPEND_STAT("rdma_read_chunks", "%llu", (unsigned long long)thread_stats.rdma_read_chunks);
+    APPEND_STAT("rdma_send_chains", "%llu", (unsigned long long)thread_stats.rdma_send_chains);
+    APPEND_STAT("rdma_cq_wakeups", "%llu", (unsigned long long)thread_stats.rdma_cq_wakeups);
+    if (RDMA_POLL_EVENT != rdma_context.poll_mode) {
+        APPEND_STAT("rdma_cq_spins", "%llu", (unsigned long long)thread_stats.rdma_cq_spins);
+        APPEND_STAT("rdma_cq_rearms", "%llu", (unsigned long long)thread_stats.rdma_cq_rearms);
+    }
+    if (rdma_context.arena_mr) {
+        APPEND_STAT("rdma_zero_copy", "%llu", (unsigned long long)thread_stats.rdma_zero_copy);
+        APPEND_STAT("rdma_arena_reg_usec", "%llu", (unsigned long long)stats.rdma_arena_reg_usec);
+    }
     APPEND_STAT("limit_maxbytes", "%llu", (unsigned long long)settings.maxbytes);
     APPEND_STAT("accepting_conns", "%u", stats.accepting_conns);
     APPEND_STAT("listen_disabled_num", "%llu", (unsigned long long)stats.listen_disabled_num);
@@ -2769,6 +3100,30 @@ static void process_stat_settings(ADD_STAT add_stats, void *c) {
     APPEND_STAT("hot_lru_pct", "%d", settings.hot_lru_pct);
     APPEND_STAT("warm_lru_pct", "%d", settings.hot_lru_pct);
     APPEND_STAT("expirezero_does_not_evict", "%s", settings.expirezero_does_not_evict ? "yes" : "no");
+    APPEND_STAT("rdma_send_pool_size", "%lu", (unsigned long)rdma_context.send_pool_size);
+    APPEND_STAT("rdma_send_arena_size", "%lu", (unsigned long)rdma_context.send_arena_size);
+    APPEND_STAT("rdma_recv_small_size", "%d", rdma_context.recv_small_size);
+    APPEND_STAT("rdma_recv_small_count", "%d", rdma_context.recv_small_count);
+    APPEND_STAT("rdma_recv_large_size", "%d", rdma_context.buff_size);
+    APPEND_STAT("rdma_recv_large_count", "%d", rdma_context.buff_per_thread);
+    APPEND_STAT("rdma_recv_growth", "%d", rdma_context.recv_growth);
+    APPEND_STAT("rdma_inline_size", "%d", rdma_context.inline_size);
+    APPEND_STAT("rdma_arena_mr", "%s", rdma_context.arena_mr ? "yes" : "no");
+    APPEND_STAT("rdma_zero_copy_min", "%d", rdma_context.zero_copy_min);
+    APPEND_STAT("rdma_remote_index", "%d", rdma_context.rindex_power);
+    APPEND_STAT("rdma_signal_interval", "%d", rdma_context.signal_interval);
+    APPEND_STAT("rdma_poll", "%s", rdma_context.poll_mode == RDMA_POLL_BUSY ? "busy"
+                : rdma_context.poll_mode == RDMA_POLL_ADAPTIVE ? "adaptive" : "event");
+    APPEND_STAT("rdma_spin_usec", "%d", rdma_context.spin_usec);
+    APPEND_STAT("rdma_devices", "%d", rdma_context.ndevices);
+    APPEND_STAT("rdma_conn_pool", "%d", rdma_context.conn_pool_max);
+    APPEND_STAT("rdma_placement", "%s", rdma_context.placement == RDMA_PLACE_RR ? "rr"
+                : rdma_context.placement == RDMA_PLACE_HOST ? "host" : "load");
+    APPEND_STAT("rdma_rebalance", "%d", rdma_context.rebalance_secs);
+    APPEND_STAT("rdma_ud_count", "%d", rdma_context.ud_count);
+    APPEND_STAT("rdma_credits", "%d", rdma_context.credits);
+    APPEND_STAT("rdma_qp_pool", "%d", rdma_context.qp_pool);
+    APPEND_STAT("rdma_counters", "%d", rdma_context.counters_power);
 }
 
 static void conn_to_str(const conn *c, char *buf) {
@@ -2929,6 +3284,8 @@ static void process_stat(conn *c, token_t *tokens, const size_t ntokens) {
         return ;
     } else if (strcmp(subcommand, "conns") == 0) {
         process_stats_conns(&append_stats, c);
+    } else if (strcmp(subcommand, "threads") == 0) {
+        rdma_thread_stats(&append_stats, c);
     } else {
         /* getting here means that the subcommand is either engine specific or
            is invalid. query the engine and see. */
@@ -2962,7 +3319,10 @@ static char kValue[] = "VALUE ";
 static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens, bool return_cas) {
     char *key;
     size_t nkey;
-    int i = 0;
+    /* RDMA appends to the replies already queued for a pipelined receive */
+    int i = c->ileft;
+    int first = i;
+    int si = c->suffixleft;
     item *it;
     token_t *key_token = &tokens[KEY_TOKEN];
     char *suffix;
@@ -2976,7 +3336,7 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
 
             if(nkey > KEY_MAX_LENGTH) {
                 out_string(c, "CLIENT_ERROR bad command line format");
-                while (i-- > 0) {
+                while (i-- > first) {
                     item_remove(*(c->ilist + i));
                 }
                 return;
@@ -3014,7 +3374,7 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
                   MEMCACHED_COMMAND_GET(c->sfd, ITEM_key(it), it->nkey,
                                         it->nbytes, ITEM_get_cas(it));
                   /* Goofy mid-flight realloc. */
-                  if (i >= c->suffixsize) {
+                  if (si >= c->suffixsize) {
                     char **new_suffix_list = realloc(c->suffixlist,
                                            sizeof(char *) * c->suffixsize * 2);
                     if (new_suffix_list) {
@@ -3036,12 +3396,13 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
                       STATS_UNLOCK();
                       out_of_memory(c, "SERVER_ERROR out of memory making CAS suffix");
                       item_remove(it);
-                      while (i-- > 0) {
+                      while (i-- > first) {
                           item_remove(*(c->ilist + i));
                       }
                       return;
                   }
-                  *(c->suffixlist + i) = suffix;
+                  *(c->suffixlist + si) = suffix;
+                  si++;
                   int suffix_len = snprintf(suffix, SUFFIX_SIZE,
                                             " %llu\r\n",
                                             (unsigned long long)ITEM_get_cas(it));
@@ -3049,7 +3410,23 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
                       add_iov(c, ITEM_key(it), it->nkey) != 0 ||
                       add_iov(c, ITEM_suffix(it), it->nsuffix - 2) != 0 ||
                       add_iov(c, suffix, suffix_len) != 0 ||
-                      add_iov(c, ITEM_data(it), it->nbytes) != 0)
+                      ((it->it_flags & ITEM_COUNTER)
+                       ? rdma_counter_add_iov(c, it, &si, it->nbytes)
+                       : add_item_iov(c, ITEM_data(it), it->nbytes)) != 0)
+                      {
+                          item_remove(it);
+                          break;
+                      }
+                }
+                else if (it->it_flags & ITEM_COUNTER)
+                {
+                  /* the value is rendered from the counter table */
+                  MEMCACHED_COMMAND_GET(c->sfd, ITEM_key(it), it->nkey,
+                                        it->nbytes, ITEM_get_cas(it));
+                  if (add_iov(c, kValue, 6) != 0 ||
+                      add_iov(c, ITEM_key(it), it->nkey) != 0 ||
+                      add_iov(c, ITEM_suffix(it), it->nsuffix) != 0 ||
+                      rdma_counter_add_iov(c, it, &si, it->nbytes) != 0)
                       {
                           item_remove(it);
                           break;
@@ -3061,7 +3438,7 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
                                         it->nbytes, ITEM_get_cas(it));
                   if (add_iov(c, kValue, 6) != 0 ||
                       add_iov(c, ITEM_key(it), it->nkey) != 0 ||
-                      add_iov(c, ITEM_suffix(it), it->nsuffix + it->nbytes) != 0)
+                      add_item_iov(c, ITEM_suffix(it), it->nsuffix + it->nbytes) != 0)
                       {
                           item_remove(it);
                           break;
@@ -3111,10 +3488,9 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
 
     c->icurr = c->ilist;
     c->ileft = i;
-    if (return_cas) {
-        c->suffixcurr = c->suffixlist;
-        c->suffixleft = i;
-    }
+    /* CAS suffixes and rendered counters */
+    c->suffixcurr = c->suffixlist;
+    c->suffixleft = si;
 
     if (settings.verbose > 1)
         fprintf(stderr, ">%d END\n", c->sfd);
@@ -3125,7 +3501,8 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
         in \r\n. So we send SERVER_ERROR instead.
     */
     static char kEnd[] = "END\r\n";
-    if (key_token->value != NULL || add_iov(c, kEnd, 5) != 0
+    if (key_token->value != NULL
+        || (!rdma_end_implied(c) && add_iov(c, kEnd, 5) != 0)
         || (IS_UDP(c->transport) && build_udp_headers(c) != 0)) {
         out_of_memory(c, "SERVER_ERROR out of memory writing get response");
     }
@@ -3310,6 +3687,9 @@ static void process_arithmetic_command(conn *c, token_t *tokens, const size_t nt
 
         out_string(c, "NOT_FOUND");
         break;
+    case DELTA_ITEM_REMOTE_ONLY:
+        out_string(c, "CLIENT_ERROR counter is only updated remotely");
+        break;
     case DELTA_ITEM_CAS_MISMATCH:
         break; /* Should never get here */
     }
@@ -3352,12 +3732,22 @@ enum delta_result_type do_add_delta(conn *c, const char *key, const size_t nkey,
 
     ptr = ITEM_data(it);
 
-    if (!safe_strtoull(ptr, &value)) {
+    if (it->it_flags & ITEM_COUNTER) {
+        /* updated in place, alongside the clients' remote atomics */
+        if (!rdma_context.counters_local) {
+            do_item_remove(it);
+            return DELTA_ITEM_REMOTE_ONLY;
+        }
+        value = rdma_counter_add(it, incr, delta);
+        if (incr) {
+            MEMCACHED_COMMAND_INCR(c->sfd, ITEM_key(it), it->nkey, value);
+        } else {
+            MEMCACHED_COMMAND_DECR(c->sfd, ITEM_key(it), it->nkey, value);
+        }
+    } else if (!safe_strtoull(ptr, &value)) {
         do_item_remove(it);
         return NON_NUMERIC;
-    }
-
-    if (incr) {
+    } else if (incr) {
         value += delta;
         MEMCACHED_COMMAND_INCR(c->sfd, ITEM_key(it), it->nkey, value);
     } else {
@@ -3382,7 +3772,10 @@ enum delta_result_type do_add_delta(conn *c, const char *key, const size_t nkey,
     /* refcount == 2 means we are the only ones holding the item, and it is
      * linked. We hold the item's lock in this function, so refcount cannot
      * increase. */
-    if (res + 2 <= it->nbytes && it->refcount == 2) { /* replace in-place */
+    if (it->it_flags & ITEM_COUNTER) {
+        ITEM_set_cas(it, (settings.use_cas) ? get_cas_id() : 0);
+        do_item_update(it);
+    } else if (res + 2 <= it->nbytes && it->refcount == 2) { /* replace in-place */
         /* When changing the value without replacing the item, we
            need to update the CAS on the existing item. */
         ITEM_set_cas(it, (settings.use_cas) ? get_cas_id() : 0);
@@ -3390,6 +3783,7 @@ enum delta_result_type do_add_delta(conn *c, const char *key, const size_t nkey,
         memcpy(ITEM_data(it), buf, res);
         memset(ITEM_data(it) + res, ' ', it->nbytes - res - 2);
         do_item_update(it);
+        rdma_rindex_publish(it, hv);
     } else if (it->refcount > 1) {
         item *new_it;
         new_it = do_item_alloc(ITEM_key(it), it->nkey, atoi(ITEM_suffix(it) + 1), it->exptime, res + 2, hv);
@@ -3400,6 +3794,7 @@ enum delta_result_type do_add_delta(conn *c, const char *key, const size_t nkey,
         memcpy(ITEM_data(new_it), buf, res);
         memcpy(ITEM_data(new_it) + res, "\r\n", 2);
         item_replace(it, new_it, hv);
+        rdma_rindex_publish(new_it, hv);
         // Overwrite the older item's CAS with our new CAS since we're
         // returning the CAS of the old item below.
         ITEM_set_cas(it, (settings.use_cas) ? ITEM_get_cas(new_it) : 0);
@@ -3422,6 +3817,110 @@ enum delta_result_type do_add_delta(conn *c, const char *key, const size_t nkey,
     return OK;
 }
 
+/*
+ * Stores a counter item, giving it a slot of the counter table that starts
+ * at initial. The item is allocated with RDMA_COUNTER_NBYTES of data, which
+ * only keep the slot; see "Remote-atomic counters" in memcached.h.
+ *
+ * Returns NOT_STORED when every slot near the key's hash is taken.
+ */
+enum store_item_type do_counter_store(item *it, conn *c, const uint64_t initial,
+                                      uint32_t *slot, const uint32_t hv) {
+    enum store_item_type stored;
+
+    if (!rdma_counter_claim(it, hv, slot)) {
+        pthread_mutex_lock(&c->thread->stats.mutex);
+        c->thread->stats.rdma_counter_full++;
+        pthread_mutex_unlock(&c->thread->stats.mutex);
+        return NOT_STORED;
+    }
+    rdma_context.counters[*slot] = initial;
+
+    stored = do_store_item(it, NREAD_SET, c, hv);
+    if (stored == STORED) {
+        pthread_mutex_lock(&c->thread->stats.mutex);
+        c->thread->stats.rdma_counter_creates++;
+        pthread_mutex_unlock(&c->thread->stats.mutex);
+    }
+    return stored;
+}
+
+static void process_counter_command(conn *c, token_t *tokens, const size_t ntokens) {
+    char buf[32];
+    char *key;
+    size_t nkey;
+    unsigned int flags;
+    int32_t exptime_int = 0;
+    time_t exptime;
+    uint64_t initial;
+    uint32_t slot;
+    item *it;
+
+    assert(c != NULL);
+
+    set_noreply_maybe(c, tokens, ntokens);
+
+    if (!rdma_context.counters) {
+        out_string(c, "CLIENT_ERROR counters are off, see -o rdma_counters");
+        return;
+    }
+
+    if (tokens[KEY_TOKEN].length > KEY_MAX_LENGTH) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+
+    key = tokens[KEY_TOKEN].value;
+    nkey = tokens[KEY_TOKEN].length;
+
+    /* "counter <key>" looks up the slot of an existing counter */
+    if (ntokens == 3) {
+        it = item_get(key, nkey);
+        if (it && (it->it_flags & ITEM_COUNTER)) {
+            snprintf(buf, sizeof(buf), "COUNTER %u", rdma_counter_slot(it));
+            out_string(c, buf);
+        } else {
+            out_string(c, "NOT_FOUND");
+        }
+        if (it) {
+            item_remove(it);
+        }
+        return;
+    }
+
+    if (! (safe_strtoul(tokens[2].value, (uint32_t *)&flags)
+           && safe_strtol(tokens[3].value, &exptime_int)
+           && safe_strtoull(tokens[4].value, &initial))) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+
+    exptime = exptime_int;
+    /* as in process_update_command() */
+    if (exptime < 0)
+        exptime = REALTIME_MAXDELTA + 1;
+
+    if (settings.detail_enabled) {
+        stats_prefix_record_set(key, nkey);
+    }
+
+    it = item_alloc(key, nkey, flags, realtime(exptime), RDMA_COUNTER_NBYTES);
+    if (it == 0) {
+        out_of_memory(c, "SERVER_ERROR out of memory storing object");
+        return;
+    }
+    memset(ITEM_data(it), 0, it->nbytes - 2);
+    memcpy(ITEM_data(it) + it->nbytes - 2, "\r\n", 2);
+
+    if (counter_store(it, c, initial, &slot) == STORED) {
+        snprintf(buf, sizeof(buf), "COUNTER %u", slot);
+        out_string(c, buf);
+    } else {
+        out_string(c, "SERVER_ERROR no free counter slot");
+    }
+    item_remove(it);
+}
+
 static void process_delete_command(conn *c, token_t *tokens, const size_t ntokens) {
     char *key;
     size_t nkey;
@@ -3462,6 +3961,13 @@ static void process_delete_command(conn *c, token_t *tokens, const size_t ntoken
         c->thread->stats.slab_stats[ITEM_clsid(it)].delete_hits++;
         pthread_mutex_unlock(&c->thread->stats.mutex);
 
+        if (rdma_context.rindex) {
+            uint32_t hv = hash(key, nkey);
+            item_lock(hv);
+            rdma_rindex_retract(hv);
+            item_unlock(hv);
+        }
+
         item_unlink(it);
         item_remove(it);      /* release our reference */
         out_string(c, "DELETED");
@@ -3573,6 +4079,10 @@ static void process_command(conn *c, char *command) {
 
         process_touch_command(c, tokens, ntokens);
 
+    } else if ((ntokens == 3 || ntokens == 6 || ntokens == 7) && (strcmp(tokens[COMMAND_TOKEN].value, "counter") == 0)) {
+
+        process_counter_command(c, tokens, ntokens);
+
     } else if (ntokens >= 2 && (strcmp(tokens[COMMAND_TOKEN].value, "stats") == 0)) {
 
         process_stat(c, tokens, ntokens);
@@ -3880,6 +4390,7 @@ static int try_read_command(conn *c) {
         assert(cont <= (c->rcurr + c->rbytes));
 
         c->last_cmd_time = current_time;
+        c->rcont = cont;
         process_command(c, c->rcurr);
 
         c->rbytes -= (cont - c->rcurr);
@@ -4840,6 +5351,10 @@ static void clock_handler(const int fd, const short which, void *arg) {
     event_base_set(main_base, &clockevent);
     evtimer_add(&clockevent, &t);
 
+    if (rdma_context.rebalance_secs > 0) {
+        rdma_rebalance_tick();
+    }
+
 #if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
     if (monotonic) {
         struct timespec ts;
@@ -4901,6 +5416,8 @@ static void usage(void) {
            "              is turned on automatically; if not, then it may be turned on\n"
            "              by sending the \"stats detail on\" command to the server.\n");
     printf("-t <num>      number of threads to use (default: 4)\n");
+    printf("-x <list>     RDMA devices to serve, comma separated indexes or \"all\",\n"
+           "              split into groups of worker threads (default: 0)\n");
     printf("-R            Maximum number of requests per event, limits the number of\n"
            "              requests process for a given connection to prevent \n"
            "              starvation (default: 20)\n");
@@ -4937,6 +5454,53 @@ static void usage(void) {
            "                (requires lru_maintainer)\n"
            "              - expirezero_does_not_evict: Items set to not expire, will not evict.\n"
            "                (requires lru_maintainer)\n"
+           "              - rdma_send_pool_size: Bytes of pre-registered send buffers\n"
+           "                per size class and worker thread (default: 1m)\n"
+           "              - rdma_send_arena_size: Bytes of registered memory per\n"
+           "                worker that all its conns stage replies in (default: 8m)\n"
+           "              - rdma_recv_small_size: Size of the small receive buffers\n"
+           "                clients can ask for at connect (default: 4096)\n"
+           "              - rdma_recv_small_count: Small receive buffers per worker\n"
+           "                (default: 1024; -K and -Y size the large class)\n"
+           "              - rdma_recv_growth: How many times its initial count a\n"
+           "                receive class may grow to when its srq runs low (default: 4)\n"
+           "              - rdma_inline_size: Send replies up to this many bytes\n"
+           "                inline, capped by the device (default: 128, 0 disables)\n"
+           "              - rdma_arena_mr: Register item memory once per worker pd\n"
+           "                and send large values without copying (needs ODP)\n"
+           "              - rdma_zero_copy_min: Smallest item value sent in place\n"
+           "                when rdma_arena_mr is on (default: 4096)\n"
+           "              - rdma_remote_index: Publish a 2^N slot index that\n"
+           "                clients read with one-sided RDMA (default N: 16).\n"
+           "                Items up to 512 bytes are copied into it, so any\n"
+           "                client can read any published item.\n"
+           "              - rdma_signal_interval: Request a completion for every\n"
+           "                Nth response sent (default: 16)\n"
+           "              - rdma_poll: How workers wait for completions:\n"
+           "                event, busy or adaptive (default: event)\n"
+           "              - rdma_spin_usec: Busy-poll budget after activity\n"
+           "                (default: 50)\n"
+           "              - rdma_conn_pool: Closed connections each worker keeps\n"
+           "                for reuse (default: 64)\n"
+           "              - rdma_placement: How new connections pick a worker:\n"
+           "                load, rr or host (default: load)\n"
+           "              - rdma_rebalance: Seconds a worker may stay twice as\n"
+           "                loaded as its quietest peer before its busiest\n"
+           "                connection is closed for the client to reconnect\n"
+           "                (default: 0, off)\n"
+           "              - rdma_ud_count: Datagram receive buffers per worker;\n"
+           "                enables the UD transport on the RDMA UDP port\n"
+           "                (default: 0, off)\n"
+           "              - rdma_credits: Credits granted to each client that\n"
+           "                asks for flow control (default: 32, at most 32,\n"
+           "                0 is off)\n"
+           "              - rdma_qp_pool: Queue pairs each worker creates ahead\n"
+           "                of connects, per receive class (default: 16)\n"
+           "              - rdma_counters: Keep counters in a 2^N slot table\n"
+           "                clients update with RDMA atomics (default N: 16).\n"
+           "                Every connected client can read and atomically\n"
+           "                modify any slot; there is no isolation between\n"
+           "                clients, so use with trusted clients only.\n"
            );
     return;
 }
@@ -5143,6 +5707,64 @@ static bool sanitycheck(void) {
     return true;
 }
 
+/*
+ * Finds the inline size the device's RC qps accept with a throwaway qp,
+ * stepping down from rdma_inline_size until the provider takes it. Done
+ * before the workers start, so they only read it.
+ */
+static int
+rdma_probe_max_inline(rdma_device_t *dev) {
+    struct ibv_qp_init_attr init_qp_attr;
+    struct ibv_pd *pd = NULL;
+    struct ibv_cq *cq = NULL;
+    struct ibv_qp *qp = NULL;
+    int inline_size = rdma_context.inline_size;
+
+    if ( !(pd = ibv_alloc_pd(dev->verbs)) ) {
+        perror("ibv_alloc_pd()");
+        return -1;
+    }
+    if ( !(cq = ibv_create_cq(dev->verbs, 1, NULL, NULL, 0)) ) {
+        perror("ibv_create_cq()");
+        ibv_dealloc_pd(pd);
+        return -1;
+    }
+
+    memset(&init_qp_attr, 0, sizeof(init_qp_attr));
+    init_qp_attr.qp_type = IBV_QPT_RC;
+    init_qp_attr.send_cq = cq;
+    init_qp_attr.recv_cq = cq;
+    init_qp_attr.cap.max_send_wr = RDMA_SEND_WR;
+    init_qp_attr.cap.max_recv_wr = 1;
+    init_qp_attr.cap.max_send_sge = RDMA_MAX_SEND_SGE;
+    init_qp_attr.cap.max_recv_sge = 1;
+
+    for (;;) {
+        init_qp_attr.cap.max_inline_data = inline_size;
+        if ((qp = ibv_create_qp(pd, &init_qp_attr))) {
+            break;
+        }
+        if (0 == inline_size) {
+            perror("ibv_create_qp()");
+            break;
+        }
+        inline_size /= 2;
+    }
+
+    if (qp) {
+        dev->max_inline = init_qp_attr.cap.max_inline_data;
+        ibv_destroy_qp(qp);
+        if (settings.verbose > 0) {
+            fprintf(stderr, "device %s: max inline data %d\n",
+                    ibv_get_device_name(dev->verbs->device), dev->max_inline);
+        }
+    }
+    ibv_destroy_cq(cq);
+    ibv_dealloc_pd(pd);
+
+    return qp ? 0 : -1;
+}
+
 /***************************************************************************//**
  * init global rdma resources 
  ******************************************************************************/
@@ -5157,13 +5779,75 @@ static int init_rdma_global_resources() {
         perror("rdma_get_devices()");
         return -1;
     }
-    /* Assume only one device */
-    rdma_context.device_ctx_used = rdma_context.device_ctx_list[rdma_context.device_index];
-
     if (settings.verbose > 0) {
         fprintf(stderr, "Device number: %d\n", num_device);
     }
 
+    int i = 0;
+    rdma_context.ndevices = 0;
+    for (i = 0; i < num_device && i < RDMA_MAX_DEVICES; ++i) {
+        if (rdma_context.device_mask & (1U << i)) {
+            rdma_context.devices[rdma_context.ndevices].verbs = rdma_context.device_ctx_list[i];
+            rdma_context.devices[rdma_context.ndevices].max_inline = -1;
+            rdma_context.ndevices++;
+        }
+    }
+    if (0 == rdma_context.ndevices) {
+        fprintf(stderr, "No RDMA device selected with -x\n");
+        return -1;
+    }
+    if (rdma_context.ndevices > settings.num_threads) {
+        fprintf(stderr, "Need at least one worker thread per RDMA device\n");
+        return -1;
+    }
+    for (i = 0; i < rdma_context.ndevices; ++i) {
+        if (0 != rdma_probe_max_inline(&rdma_context.devices[i])) {
+            return -1;
+        }
+    }
+
+    if (rdma_context.rindex_power > 0) {
+        size_t len = (sizeof(rdma_rindex_slot_t) + RDMA_RINDEX_DATA)
+                     << rdma_context.rindex_power;
+        if (0 != posix_memalign((void **)&rdma_context.rindex, 4096, len)) {
+            fprintf(stderr, "out of memory allocating the remote index\n");
+            return -1;
+        }
+        memset(rdma_context.rindex, 0, len);
+        rdma_context.rindex_data = (char *)(rdma_context.rindex
+                                            + (1U << rdma_context.rindex_power));
+    }
+
+    if (rdma_context.counters_power > 0) {
+        size_t len = sizeof(uint64_t) << rdma_context.counters_power;
+        if (0 != posix_memalign((void **)&rdma_context.counters, 4096, len)
+            || !(rdma_context.counter_owners = calloc(1U << rdma_context.counters_power,
+                                                      sizeof(item *)))) {
+            fprintf(stderr, "out of memory allocating the counter table\n");
+            return -1;
+        }
+        memset((void *)rdma_context.counters, 0, len);
+
+        /* checked once here; the workers register the table concurrently */
+        for (i = 0; i < rdma_context.ndevices; ++i) {
+            struct ibv_context *verbs = rdma_context.devices[i].verbs;
+            struct ibv_device_attr attr;
+
+            if (0 != ibv_query_device(verbs, &attr)) {
+                perror("ibv_query_device()");
+                return -1;
+            }
+            if (attr.atomic_cap == IBV_ATOMIC_NONE) {
+                fprintf(stderr, "device %s has no remote atomics for rdma_counters\n",
+                        ibv_get_device_name(verbs->device));
+                return -1;
+            }
+            if (attr.atomic_cap != IBV_ATOMIC_GLOB) {
+                rdma_context.counters_local = false;
+            }
+        }
+    }
+
     return 0;
 }
 
@@ -5192,6 +5876,26 @@ static int attach_rdma_listen_event() {
         perror("event_add()");
         return -1;
     }
+
+    /* device async events are handled here too, next to the cm events */
+    int i = 0;
+    for (i = 0; i < rdma_context.ndevices; ++i) {
+        rdma_device_t *dev = &rdma_context.devices[i];
+        int flags = fcntl(dev->verbs->async_fd, F_GETFL);
+
+        if (flags < 0 || fcntl(dev->verbs->async_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+            perror("setting O_NONBLOCK on the async fd");
+            return -1;
+        }
+
+        event_set(&dev->async_event, dev->verbs->async_fd, EV_READ | EV_PERSIST,
+                rdma_async_event_handler, dev);
+        event_base_set(main_base, &dev->async_event);
+        if (0 != event_add(&dev->async_event, NULL)) {
+            perror("event_add()");
+            return -1;
+        }
+    }
     return 0;
 }
 
@@ -5221,6 +5925,8 @@ int main (int argc, char **argv) {
     bool start_lru_crawler = false;
     enum hashfunc_type hash_type = JENKINS_HASH;
     uint32_t tocrawl;
+    uint32_t send_pool_size;
+    uint32_t send_arena_size;
 
     char *subopts;
     char *subopts_value;
@@ -5237,7 +5943,26 @@ int main (int argc, char **argv) {
         LRU_MAINTAINER,
         HOT_LRU_PCT,
         WARM_LRU_PCT,
-        NOEXP_NOEVICT
+        NOEXP_NOEVICT,
+        RDMA_SEND_POOL_SIZE,
+        RDMA_SEND_ARENA_SIZE,
+        RDMA_RECV_SMALL_SIZE,
+        RDMA_RECV_SMALL_COUNT,
+        RDMA_RECV_GROWTH,
+        RDMA_INLINE_SIZE,
+        RDMA_ARENA_MR,
+        RDMA_ZERO_COPY_MIN,
+        RDMA_REMOTE_INDEX,
+        RDMA_SIGNAL_INTERVAL,
+        RDMA_POLL,
+        RDMA_SPIN_USEC,
+        RDMA_CONN_POOL,
+        RDMA_PLACEMENT,
+        RDMA_REBALANCE,
+        RDMA_UD_COUNT,
+        RDMA_CREDITS,
+        RDMA_QP_POOL,
+        RDMA_COUNTERS
     };
     char *const subopts_tokens[] = {
         [MAXCONNS_FAST] = "maxconns_fast",
@@ -5253,6 +5978,25 @@ int main (int argc, char **argv) {
         [HOT_LRU_PCT] = "hot_lru_pct",
         [WARM_LRU_PCT] = "warm_lru_pct",
         [NOEXP_NOEVICT] = "expirezero_does_not_evict",
+        [RDMA_SEND_POOL_SIZE] = "rdma_send_pool_size",
+        [RDMA_SEND_ARENA_SIZE] = "rdma_send_arena_size",
+        [RDMA_RECV_SMALL_SIZE] = "rdma_recv_small_size",
+        [RDMA_RECV_SMALL_COUNT] = "rdma_recv_small_count",
+        [RDMA_RECV_GROWTH] = "rdma_recv_growth",
+        [RDMA_INLINE_SIZE] = "rdma_inline_size",
+        [RDMA_ARENA_MR] = "rdma_arena_mr",
+        [RDMA_ZERO_COPY_MIN] = "rdma_zero_copy_min",
+        [RDMA_REMOTE_INDEX] = "rdma_remote_index",
+        [RDMA_SIGNAL_INTERVAL] = "rdma_signal_interval",
+        [RDMA_POLL] = "rdma_poll",
+        [RDMA_SPIN_USEC] = "rdma_spin_usec",
+        [RDMA_CONN_POOL] = "rdma_conn_pool",
+        [RDMA_PLACEMENT] = "rdma_placement",
+        [RDMA_REBALANCE] = "rdma_rebalance",
+        [RDMA_UD_COUNT] = "rdma_ud_count",
+        [RDMA_CREDITS] = "rdma_credits",
+        [RDMA_QP_POOL] = "rdma_qp_pool",
+        [RDMA_COUNTERS] = "rdma_counters",
         NULL
     };
 
@@ -5322,7 +6066,22 @@ int main (int argc, char **argv) {
             rdma_context.buff_size = atoi(optarg);
             break;
         case 'x':
-            rdma_context.device_index = atoi(optarg);
+            if (strcmp(optarg, "all") == 0) {
+                rdma_context.device_mask = ~0U;
+            } else {
+                char *tok = NULL, *save = NULL;
+                rdma_context.device_mask = 0;
+                for (tok = strtok_r(optarg, ",", &save); tok;
+                     tok = strtok_r(NULL, ",", &save)) {
+                    int idx = atoi(tok);
+                    if (idx < 0 || idx >= RDMA_MAX_DEVICES) {
+                        fprintf(stderr, "RDMA device index must be between 0 and %d\n",
+                                RDMA_MAX_DEVICES - 1);
+                        return 1;
+                    }
+                    rdma_context.device_mask |= 1U << idx;
+                }
+            }
             break;
         case 'A':
             /* enables "shutdown" command */
@@ -5623,10 +6382,235 @@ int main (int argc, char **argv) {
             case NOEXP_NOEVICT:
                 settings.expirezero_does_not_evict = true;
                 break;
-            default:
-                printf("Illegal suboption \"%s\"\n", subopts_value);
-                return 1;
-            }
+            case RDMA_SEND_POOL_SIZE:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing rdma_send_pool_size argument\n");
+                    return 1;
+                };
+                if (!safe_strtoul(subopts_value, &send_pool_size) ||
+                    send_pool_size < RDMA_SEND_POOL_MIN_CHUNK ||
+                    send_pool_size > RDMA_SEND_POOL_MAX_SIZE) {
+                    fprintf(stderr, "rdma_send_pool_size must be between %d and %d bytes\n",
+                            RDMA_SEND_POOL_MIN_CHUNK, RDMA_SEND_POOL_MAX_SIZE);
+                    return 1;
+                }
+                rdma_context.send_pool_size = send_pool_size;
+                break;
+            case RDMA_SEND_ARENA_SIZE:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing rdma_send_arena_size argument\n");
+                    return 1;
+                };
+                if (!safe_strtoul(subopts_value, &send_arena_size) ||
+                    send_arena_size < RDMA_ARENA_CHUNK ||
+                    send_arena_size > RDMA_ARENA_MAX_SIZE) {
+                    fprintf(stderr, "rdma_send_arena_size must be between %d and %d bytes\n",
+                            RDMA_ARENA_CHUNK, RDMA_ARENA_MAX_SIZE);
+                    return 1;
+                }
+                rdma_context.send_arena_size = send_arena_size;
+                break;
+            case RDMA_RECV_SMALL_SIZE:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing rdma_recv_small_size argument\n");
+                    return 1;
+                };
+                rdma_context.recv_small_size = atoi(subopts_value);
+                if (rdma_context.recv_small_size < 64) {
+                    fprintf(stderr, "rdma_recv_small_size must be at least 64 bytes\n");
+                    return 1;
+                }
+                break;
+            case RDMA_RECV_SMALL_COUNT:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing rdma_recv_small_count argument\n");
+                    return 1;
+                };
+                rdma_context.recv_small_count = atoi(subopts_value);
+                if (rdma_context.recv_small_count < 0) {
+                    fprintf(stderr, "rdma_recv_small_count must be non-negative\n");
+                    return 1;
+                }
+                break;
+            case RDMA_RECV_GROWTH:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing rdma_recv_growth argument\n");
+                    return 1;
+                };
+                rdma_context.recv_growth = atoi(subopts_value);
+                if (rdma_context.recv_growth < 1 || rdma_context.recv_growth > 64) {
+                    fprintf(stderr, "rdma_recv_growth must be between 1 and 64\n");
+                    return 1;
+                }
+                break;
+            case RDMA_INLINE_SIZE:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing rdma_inline_size argument\n");
+                    return 1;
+                };
+                rdma_context.inline_size = atoi(subopts_value);
+                if (rdma_context.inline_size < 0 || rdma_context.inline_size > 4096) {
+                    fprintf(stderr, "rdma_inline_size must be between 0 and 4096\n");
+                    return 1;
+                }
+                break;
+            case RDMA_ARENA_MR:
+                rdma_context.arena_mr = true;
+                break;
+            case RDMA_ZERO_COPY_MIN:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing rdma_zero_copy_min argument\n");
+                    return 1;
+                };
+                rdma_context.zero_copy_min = atoi(subopts_value);
+                if (rdma_context.zero_copy_min < 0) {
+                    fprintf(stderr, "rdma_zero_copy_min must be >= 0\n");
+                    return 1;
+                }
+                break;
+            case RDMA_REMOTE_INDEX:
+                if (subopts_value == NULL) {
+                    rdma_context.rindex_power = 16;
+                    break;
+                }
+                rdma_context.rindex_power = atoi(subopts_value);
+                /* the item lock table is at most 2^13 wide; each slot
+                 * also takes RDMA_RINDEX_DATA bytes */
+                if (rdma_context.rindex_power < 13 || rdma_context.rindex_power > 20) {
+                    fprintf(stderr, "rdma_remote_index must be between 13 and 20\n");
+                    return 1;
+                }
+                break;
+            case RDMA_SIGNAL_INTERVAL:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing rdma_signal_interval argument\n");
+                    return 1;
+                };
+                rdma_context.signal_interval = atoi(subopts_value);
+                if (rdma_context.signal_interval < 1 ||
+                    rdma_context.signal_interval > RDMA_SEND_WINDOW / 2) {
+                    fprintf(stderr, "rdma_signal_interval must be between 1 and %d\n",
+                            RDMA_SEND_WINDOW / 2);
+                    return 1;
+                }
+                break;
+            case RDMA_POLL:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing rdma_poll argument\n");
+                    return 1;
+                };
+                if (strcmp(subopts_value, "event") == 0) {
+                    rdma_context.poll_mode = RDMA_POLL_EVENT;
+                } else if (strcmp(subopts_value, "busy") == 0) {
+                    rdma_context.poll_mode = RDMA_POLL_BUSY;
+                } else if (strcmp(subopts_value, "adaptive") == 0) {
+                    rdma_context.poll_mode = RDMA_POLL_ADAPTIVE;
+                } else {
+                    fprintf(stderr, "Unknown rdma_poll option (event, busy, adaptive)\n");
+                    return 1;
+                }
+                break;
+            case RDMA_SPIN_USEC:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing rdma_spin_usec argument\n");
+                    return 1;
+                };
+                rdma_context.spin_usec = atoi(subopts_value);
+                if (rdma_context.spin_usec < 0 || rdma_context.spin_usec > 1000000) {
+                    fprintf(stderr, "rdma_spin_usec must be between 0 and 1 second\n");
+                    return 1;
+                }
+                break;
+            case RDMA_CONN_POOL:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing rdma_conn_pool argument\n");
+                    return 1;
+                };
+                rdma_context.conn_pool_max = atoi(subopts_value);
+                if (rdma_context.conn_pool_max < 0) {
+                    fprintf(stderr, "rdma_conn_pool must be non-negative\n");
+                    return 1;
+                }
+                break;
+            case RDMA_PLACEMENT:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing rdma_placement argument\n");
+                    return 1;
+                };
+                if (strcmp(subopts_value, "load") == 0) {
+                    rdma_context.placement = RDMA_PLACE_LOAD;
+                } else if (strcmp(subopts_value, "rr") == 0) {
+                    rdma_context.placement = RDMA_PLACE_RR;
+                } else if (strcmp(subopts_value, "host") == 0) {
+                    rdma_context.placement = RDMA_PLACE_HOST;
+                } else {
+                    fprintf(stderr, "Unknown rdma_placement option (load, rr, host)\n");
+                    return 1;
+                }
+                break;
+            case RDMA_REBALANCE:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing rdma_rebalance argument\n");
+                    return 1;
+                };
+                rdma_context.rebalance_secs = atoi(subopts_value);
+                if (rdma_context.rebalance_secs < 0) {
+                    fprintf(stderr, "rdma_rebalance must be non-negative\n");
+                    return 1;
+                }
+                break;
+            case RDMA_UD_COUNT:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing rdma_ud_count argument\n");
+                    return 1;
+                };
+                rdma_context.ud_count = atoi(subopts_value);
+                if (rdma_context.ud_count < 0) {
+                    fprintf(stderr, "rdma_ud_count must be non-negative\n");
+                    return 1;
+                }
+                break;
+            case RDMA_CREDITS:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing rdma_credits argument\n");
+                    return 1;
+                };
+                rdma_context.credits = atoi(subopts_value);
+                /* a client within its window must never overflow the
+                 * receives parked on its conn */
+                if (rdma_context.credits < 0 || rdma_context.credits > RDMA_PENDING_RECV) {
+                    fprintf(stderr, "rdma_credits must be between 0 and %d\n",
+                            RDMA_PENDING_RECV);
+                    return 1;
+                }
+                break;
+            case RDMA_QP_POOL:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing rdma_qp_pool argument\n");
+                    return 1;
+                };
+                rdma_context.qp_pool = atoi(subopts_value);
+                if (rdma_context.qp_pool < 0) {
+                    fprintf(stderr, "rdma_qp_pool must be non-negative\n");
+                    return 1;
+                }
+                break;
+            case RDMA_COUNTERS:
+                if (subopts_value == NULL) {
+                    rdma_context.counters_power = 16;
+                    break;
+                }
+                rdma_context.counters_power = atoi(subopts_value);
+                /* slots share the item lock of the key's low 13 hash bits */
+                if (rdma_context.counters_power < 13 || rdma_context.counters_power > 24) {
+                    fprintf(stderr, "rdma_counters must be between 13 and 24\n");
+                    return 1;
+                }
+                break;
+            default:
+                printf("Illegal suboption \"%s\"\n", subopts_value);
+                return 1;
+            }
 
             }
             break;
@@ -5641,6 +6625,11 @@ int main (int argc, char **argv) {
         exit(EX_USAGE);
     }
 
+    if (rdma_context.recv_small_count <= 0 && rdma_context.buff_per_thread <= 0) {
+        fprintf(stderr, "At least one class of receive buffers is needed\n");
+        exit(EX_USAGE);
+    }
+
     if (hash_init(hash_type) != 0) {
         fprintf(stderr, "Failed to initialize hash_algorithm!\n");
         exit(EX_USAGE);
@@ -5893,6 +6882,13 @@ int main (int argc, char **argv) {
             exit(EX_OSERR);
         }
 
+        /* UD clients resolve a worker's qp on the same port number */
+        if (rdma_context.ud_count > 0
+            && rdma_build(settings.port, rdma_udp, portnumber_file)) {
+            vperror("failed to listen on UDP port %d", settings.port);
+            exit(EX_OSERR);
+        }
+
         if (portnumber_file) {
             fclose(portnumber_file);
             rename(temp_portnumber_filename, portnumber_filename);
@@ -6077,9 +7073,6 @@ rdma_cm_event_handler(int fd, short libevent_event, void *arg) {
         fprintf(stderr, "RDMA CM event: %s\n", rdma_event_str(cm_event->event));
     }
 
-    struct rdma_cm_id *id = cm_event->id;
-    conn *c = id->context;
-
     switch (cm_event->event) {
         case RDMA_CM_EVENT_CONNECT_REQUEST:
             if (stats.curr_conns >= settings.maxconns) {
@@ -6090,26 +7083,11 @@ rdma_cm_event_handler(int fd, short libevent_event, void *arg) {
                 STATS_UNLOCK();
 
             } else {
-                handle_connect_request(cm_event->id);
+                handle_connect_request(cm_event);
+                return;     /* return early due to ack cm event */
             }
             break;
 
-        case RDMA_CM_EVENT_ESTABLISHED:
-            break;
-
-        case RDMA_CM_EVENT_DISCONNECTED:
-            if (settings.verbose > 0) { 
-                fprintf(stderr, "conn %p, recv msg: %d, post recv: %d, cqe %d\n\n",
-                        (void*)c, c->total_recv_msg, c->total_post_recv, c->total_cqe);
-            }
-
-            rdma_ack_cm_event(cm_event);
-            rdma_conn_cleanup(c);
-            rdma_conn_free(c);
-            rdma_destroy_qp(id);
-            rdma_destroy_id(id);
-            return;     /* return early due to ack cm event */
-
         default:
             if (settings.verbose > 0) {
                 fprintf(stderr, "do not handle this cm event\n");
@@ -6120,14 +7098,147 @@ rdma_cm_event_handler(int fd, short libevent_event, void *arg) {
     rdma_ack_cm_event(cm_event);
 }
 
+/***************************************************************************//**
+ * device async event callback
+ *
+ * Runs on the dispatcher. An srq that ran below its limit is handed to the
+ * worker that owns it, which grows it and re-arms the limit.
+ ******************************************************************************/
+static void
+rdma_async_event_handler(int fd, short libevent_event, void *arg) {
+    rdma_device_t *dev = arg;
+    struct ibv_async_event event;
+
+    while (0 == ibv_get_async_event(dev->verbs, &event)) {
+        if (settings.verbose > 0) {
+            fprintf(stderr, "RDMA async event: %s\n", ibv_event_type_str(event.event_type));
+        }
+
+        switch (event.event_type) {
+            case IBV_EVENT_SRQ_LIMIT_REACHED:
+                rdma_srq_limit_reached(event.element.srq->srq_context, event.element.srq);
+                break;
+
+            case IBV_EVENT_QP_FATAL:
+            case IBV_EVENT_QP_REQ_ERR:
+            case IBV_EVENT_QP_ACCESS_ERR:
+                rdma_qp_failed(event.element.qp);
+                STATS_LOCK();
+                stats.rdma_qp_error_events++;
+                STATS_UNLOCK();
+                break;
+
+            case IBV_EVENT_CQ_ERR: {
+                /* an overrun cq is lost along with every qp on it */
+                LIBEVENT_THREAD *t = event.element.cq->cq_context;
+                fprintf(stderr, "RDMA cq of worker %lu failed\n", (unsigned long)t->thread_id);
+                t->cq_failed = true;
+                if (write(t->notify_send_fd, "x", 1) != 1) {
+                    perror("Writing to thread notify pipe");
+                }
+                STATS_LOCK();
+                stats.rdma_cq_error_events++;
+                STATS_UNLOCK();
+                break;
+            }
+
+            case IBV_EVENT_SRQ_ERR:
+                fprintf(stderr, "RDMA srq error on %s\n", ibv_get_device_name(dev->verbs->device));
+                STATS_LOCK();
+                stats.rdma_srq_error_events++;
+                STATS_UNLOCK();
+                break;
+
+            case IBV_EVENT_PORT_ACTIVE:
+            case IBV_EVENT_LID_CHANGE:
+            case IBV_EVENT_PKEY_CHANGE:
+            case IBV_EVENT_GID_CHANGE:
+            case IBV_EVENT_SM_CHANGE:
+            case IBV_EVENT_CLIENT_REREGISTER:
+                /* cached UD address handles may point at old addresses */
+                rdma_notify_device_workers(dev, 'a');
+                /* fall through */
+            case IBV_EVENT_PORT_ERR:
+                STATS_LOCK();
+                stats.rdma_port_events++;
+                STATS_UNLOCK();
+                break;
+
+            case IBV_EVENT_DEVICE_FATAL:
+                fprintf(stderr, "RDMA device %s failed\n", ibv_get_device_name(dev->verbs->device));
+                STATS_LOCK();
+                stats.rdma_device_fatal_events++;
+                STATS_UNLOCK();
+                break;
+
+            default:
+                STATS_LOCK();
+                stats.rdma_other_events++;
+                STATS_UNLOCK();
+                break;
+        }
+
+        ibv_ack_async_event(&event);
+    }
+}
+
+/*
+ * A qp went to error. A connected one is disconnected once; its worker
+ * drains the flushed completions and tears the conn down when the
+ * DISCONNECTED event reaches its own cm channel. The UD qp is reset by its
+ * worker.
+ */
+static void
+rdma_qp_failed(struct ibv_qp *qp) {
+    if (IBV_QPT_UD == qp->qp_type) {
+        LIBEVENT_THREAD *t = qp->qp_context;
+        if (write(t->notify_send_fd, "u", 1) != 1) {
+            perror("Writing to thread notify pipe");
+        }
+        return;
+    }
+
+    conn *c = qp->qp_context;
+    if (c) {
+        rdma_conn_fail(c);
+    }
+}
+
+/* asks the cm to disconnect an RC conn, once */
+static void
+rdma_conn_fail(conn *c) {
+    if (!c->failed) {
+        c->failed = true;
+        rdma_disconnect(c->id);
+    }
+}
+
 /***************************************************************************//**
  * allocate a new conn or reuse an old conn
  *
  ******************************************************************************/
 static conn* 
-rdma_conn_new() {
-    /* RDMA TODO: retrieve a conn */
+rdma_conn_new(LIBEVENT_THREAD *thread) {
     conn *c = NULL;
+
+    /* a recycled conn keeps its wbuf and lists, which saves their mallocs;
+     * none of them are registered, the send pool and arena are per worker */
+    pthread_mutex_lock(&thread->conn_pool_lock);
+    if ((c = thread->conn_pool)) {
+        thread->conn_pool = c->next;
+        thread->conn_pool_count--;
+    }
+    pthread_mutex_unlock(&thread->conn_pool_lock);
+
+    if (c) {
+        STATS_LOCK();
+        stats.curr_conns++;
+        stats.total_conns++;
+        stats.rdma_conns_reused++;
+        STATS_UNLOCK();
+        return c;
+    }
+
     if (!(c = (conn *)calloc(1, sizeof(conn)))) {
         STATS_LOCK();
         stats.malloc_fails++;
@@ -6136,6 +7247,11 @@ rdma_conn_new() {
         return NULL;
     }
 
+    c->thread = thread;
+    c->comp_channel = thread->comp_channel;
+    c->pd = thread->pd;
+    c->cq = thread->cq;
+
     c->rbuf = c->wbuf = 0;
     c->ilist = 0;
     c->suffixlist = 0;
@@ -6143,32 +7259,27 @@ rdma_conn_new() {
     c->msglist = 0;
     c->hdrbuf = 0;
 
-    c->rsize = rdma_context.buff_size;
-    c->wsize = rdma_context.buff_size + 300;
+    /* the iov list is only used by the socket write path */
+    c->wsize = DATA_BUFFER_SIZE;
     c->isize = ITEM_LIST_INITIAL;
     c->suffixsize = SUFFIX_LIST_INITIAL;
-    c->iovsize = IOV_LIST_INITIAL;
+    c->iovsize = 0;
     c->msgsize = MSG_LIST_INITIAL;
     c->hdrsize = 0;
     
-    /* RDMA TODO: decrease memory allocate */
-    /* c->rbuf = (char *)malloc((size_t)c->rsize); */
     c->wbuf = (char *)malloc((size_t)c->wsize);
     c->ilist = (item **)malloc(sizeof(item *) * c->isize);
     c->suffixlist = (char **)malloc(sizeof(char *) * c->suffixsize);
-    c->iov = (struct iovec *)malloc(sizeof(struct iovec) * c->iovsize);
     c->msglist = (struct msghdr *)malloc(sizeof(struct msghdr) * c->msgsize);
 
-    c->sge_size = IOV_LIST_INITIAL;
+    c->sge_size = c->wmr_size = c->sbuf_size = RDMA_SGE_LIST_INITIAL;
     c->sge = malloc(sizeof(struct ibv_sge) * c->sge_size);
-    c->wmr_list = calloc(c->sge_size, sizeof(struct ibv_mr*));
-
-/*    if (c->rbuf == 0 || c->wbuf == 0 || c->ilist == 0 || c->iov == 0 ||
-            c->msglist == 0 || c->suffixlist == 0) { */
-    if (c->wbuf == 0 || c->ilist == 0 || c->iov == 0 || c->msglist == 0 || c->suffixlist == 0 ||
-        c->sge == 0 || c->wmr_list == 0) {
-        /* RDMA free */
-        rdma_conn_free(c);
+    c->wmr_list = calloc(c->wmr_size, sizeof(struct ibv_mr*));
+    c->sbuf_list = calloc(c->sbuf_size, sizeof(rdma_sbuf_t*));
+
+    if (c->wbuf == 0 || c->ilist == 0 || c->msglist == 0 || c->suffixlist == 0 ||
+        c->sge == 0 || c->wmr_list == 0 || c->sbuf_list == 0) {
+        rdma_conn_destroy(c);
         STATS_LOCK();
         stats.malloc_fails++;
         STATS_UNLOCK();
@@ -6189,68 +7300,280 @@ rdma_conn_new() {
     return c;
 }
 
+/* the client's connect private data, or NULL if it sent none of ours */
+static const rdma_conn_req_t *
+rdma_conn_req(struct rdma_conn_param *req_param) {
+    const rdma_conn_req_t *req = req_param->private_data;
+
+    /* the cm may pad private data, the version byte tells it is ours */
+    if (!req || req_param->private_data_len < sizeof(*req)
+        || RDMA_CONN_REQ_VERSION != req->version) {
+        return NULL;
+    }
+    return req;
+}
+
+/*
+ * Credits to hand back to a client with the next message: what brings it
+ * back to its window as far as the buffers posted to its class cover,
+ * but never leaving it without one. The posted count is read racily; it
+ * only shrinks while the worker holds receives it is about to repost.
+ */
+static int
+rdma_credit_grant(conn *c) {
+    rdma_recv_class_t *cls = c->rclass;
+    int want = rdma_context.credits - c->credits_held;
+    int room = cls->posted - cls->credits_out;
+    int grant = want < room ? want : room;
+
+    if (grant < 0) {
+        grant = 0;
+    }
+    if (grant < want) {
+        pthread_mutex_lock(&c->thread->stats.mutex);
+        c->thread->stats.rdma_credit_short++;
+        pthread_mutex_unlock(&c->thread->stats.mutex);
+        if (0 == c->credits_held + grant) {
+            grant = 1;
+        }
+    }
+
+    c->credits_held += grant;
+    __sync_add_and_fetch(&cls->credits_out, grant);
+    return grant;
+}
+
+/* a receive on a conn under credits; a client over its credits is only counted */
+static void
+rdma_credit_consume(conn *c) {
+    if (c->credits_held > 0) {
+        c->credits_held -= 1;
+        __sync_sub_and_fetch(&c->rclass->credits_out, 1);
+        return;
+    }
+    pthread_mutex_lock(&c->thread->stats.mutex);
+    c->thread->stats.rdma_credit_overruns++;
+    pthread_mutex_unlock(&c->thread->stats.mutex);
+}
+
+/*
+ * Picks the receive buffer class for a new conn: the smallest one that
+ * holds the largest message the client says it will send, or the large
+ * class for clients that say nothing.
+ *
+ * Returns NULL if no class with buffers is large enough.
+ */
+static rdma_recv_class_t *
+rdma_select_recv_class(LIBEVENT_THREAD *thread, struct rdma_conn_param *req_param) {
+    rdma_recv_class_t *large = &thread->recv_classes[RDMA_RECV_LARGE];
+    const rdma_conn_req_t *req = rdma_conn_req(req_param);
+    uint32_t max_msg = 0;
+    int i = 0;
+
+    if (!req) {
+        return large->count > 0 ? large : NULL;
+    }
+
+    max_msg = ntohl(req->max_msg);
+    for (i = 0; i < RDMA_RECV_CLASSES; ++i) {
+        rdma_recv_class_t *cls = &thread->recv_classes[i];
+        if (cls->count > 0 && (uint32_t)cls->size >= max_msg) {
+            return cls;
+        }
+    }
+    return NULL;
+}
+
 /***************************************************************************//**
  * handle connect request 
  *
+ * The dispatcher only picks the worker. The id moves to the worker's cm
+ * channel, and the worker creates the qp, accepts and later tears the
+ * conn down itself. SIDR requests on the UD port take the same way.
  ******************************************************************************/
-static int 
-handle_connect_request(struct rdma_cm_id *id) {
-    conn *c = rdma_conn_new();
+static void
+handle_connect_request(struct rdma_cm_event *cm_event) {
+    struct rdma_cm_id *id = cm_event->id;
+    LIBEVENT_THREAD *thread = select_rdma_thread(id);
+
+    if (!thread) {
+        if (settings.verbose > 0) {
+            fprintf(stderr, "connection on an unused device\n");
+        }
+        rdma_reject(id, NULL, 0);
+        rdma_ack_cm_event(cm_event);
+        rdma_destroy_id(id);
+        return;
+    }
+
+    /* acks the event */
+    dispatch_rdma_conn(thread, cm_event);
+}
+
+/*
+ * Runs on the worker the connect request was handed to. On failure the
+ * id is left without a qp for the caller to reject and destroy.
+ */
+int
+rdma_accept_conn(LIBEVENT_THREAD *thread, struct rdma_cm_id *id,
+                 struct rdma_conn_param *req_param) {
+    const rdma_conn_req_t *req = NULL;
+
+    rdma_recv_class_t *rclass = rdma_select_recv_class(thread, req_param);
+    if (!rclass) {
+        if (settings.verbose > 0) {
+            fprintf(stderr, "no receive buffers large enough for the client\n");
+        }
+        __sync_sub_and_fetch(&thread->load_conns, 1);
+        return -1;
+    }
+
+    conn *c = rdma_conn_new(thread);
     if (!c) {
+        __sync_sub_and_fetch(&thread->load_conns, 1);
         return -1;
     }
 
     c->id  = id; 
     id->context = c;
-    if (id->verbs != rdma_context.device_ctx_used) {
-        fprintf(stderr, "unmatched device context\n");
-        rdma_conn_free(c);
+    c->qp = NULL;
+    c->ud = NULL;
+    c->rclass = rclass;
+    c->credits_held = 0;
+    req = rdma_conn_req(req_param);
+    c->credit_flow = rdma_context.credits > 0 && req && (req->flags & RDMA_CONN_REQ_CREDITS);
+    c->srq = rclass->srq;
+    c->rsize = rclass->size;
+    
+    /* a pooled qp only has to be taken to INIT, as rdma_create_qp() would;
+     * the accept moves it on to RTS */
+    struct ibv_qp *qp = rdma_qp_pool_get(thread, rclass);
+    if (!qp && !(qp = rdma_create_rc_qp(thread, rclass))) {
+        rdma_conn_abort(c);
         return -1;
     }
 
-    assign_conn_to_thread(c);
-    
-    /* TODO: adjust the parameters */
-    struct ibv_qp_init_attr init_qp_attr;
-    memset(&init_qp_attr, 0, sizeof(init_qp_attr));
-
-    init_qp_attr.sq_sig_all = 1;
-    init_qp_attr.qp_type = IBV_QPT_RC;
-    init_qp_attr.send_cq = c->cq;
-    init_qp_attr.recv_cq = c->cq;
-    init_qp_attr.qp_context = c;
-
-    init_qp_attr.cap.max_send_wr = 128;
-    init_qp_attr.cap.max_recv_wr = rdma_context.srq_size;
-    init_qp_attr.cap.max_send_sge = 16;
-    init_qp_attr.cap.max_recv_sge = 16;
-    init_qp_attr.cap.max_inline_data = 32;
-
-    init_qp_attr.srq = c->srq;
-    if (0 != rdma_create_qp(id, c->pd, &init_qp_attr)) {
-        perror("rdma_create_qp()");
-        rdma_conn_free(c);
+    struct ibv_qp_attr qp_attr;
+    int qp_attr_mask = 0;
+    memset(&qp_attr, 0, sizeof(qp_attr));
+    qp_attr.qp_state = IBV_QPS_INIT;
+    if (0 != rdma_init_qp_attr(id, &qp_attr, &qp_attr_mask)
+        || 0 != ibv_modify_qp(qp, &qp_attr, qp_attr_mask)) {
+        perror("ibv_modify_qp()");
+        ibv_destroy_qp(qp);
+        rdma_conn_abort(c);
         return -1;
     }
+    qp->qp_context = c;
+    id->qp = qp;
     id->srq = c->srq;
+    c->qp = qp;
+
+    /* every qp of the device was created with its max inline size */
+    c->max_inline = thread->device->max_inline < rdma_context.inline_size
+        ? thread->device->max_inline : rdma_context.inline_size;
 
     if (settings.verbose > 2) {
         fprintf(stderr, "id's qp [%p], qp num [%d]\n", (void*)id->qp, id->qp->qp_num);
     }
 
-    if (0 != rdma_accept(id, NULL)) {
+    struct rdma_conn_param conn_param;
+    rdma_conn_rep_t rep;
+    memset(&conn_param, 0, sizeof(conn_param));
+    memset(&rep, 0, sizeof(rep));
+    conn_param.responder_resources = req_param->responder_resources;
+    conn_param.initiator_depth = req_param->initiator_depth;
+    c->read_depth = req_param->initiator_depth < RDMA_READ_DEPTH
+        ? req_param->initiator_depth : RDMA_READ_DEPTH;
+    if (c->read_depth < 1) {
+        c->read_depth = 1;
+    }
+    conn_param.rnr_retry_count = req_param->rnr_retry_count;
+
+    if (rdma_context.rindex) {
+        /* the rkeys are per pd, so each worker hands out its own */
+        rep.rindex.version = RDMA_RINDEX_VERSION;
+        rep.rindex.power = rdma_context.rindex_power;
+        rep.rindex.index_addr = (uintptr_t)rdma_context.rindex;
+        rep.rindex.index_rkey = c->thread->rindex_mr->rkey;
+        rep.rindex.data_size = RDMA_RINDEX_DATA;
+        conn_param.private_data = &rep;
+        conn_param.private_data_len = sizeof(rep.rindex);
+    }
+    if (c->credit_flow) {
+        rep.credits = htonl(rdma_credit_grant(c));
+        conn_param.private_data = &rep;
+        conn_param.private_data_len = sizeof(rep);
+    }
+    if (rdma_context.counters) {
+        rep.counters.counters_addr = (uintptr_t)rdma_context.counters;
+        rep.counters.counters_rkey = c->thread->counters_mr->rkey;
+        rep.counters.counters_power = rdma_context.counters_power;
+        conn_param.private_data = &rep;
+        conn_param.private_data_len = sizeof(rep);
+    }
+
+    /* the qp is polled by this thread, so it is known before the accept */
+    if (0 != rdma_conn_init(c, conn_new_cmd, DATA_BUFFER_SIZE, thread->base)
+        || 0 != rdma_accept(id, &conn_param)) {
         perror("rdma_accept()");
-        rdma_conn_free(c);
+        rdma_conn_abort(c);
+        rdma_destroy_qp(id);
         return -1;
     }
     if (settings.verbose > 0) {
         fprintf(stderr, "Accept new connection [%p].\n", (void*)id);
     }
-
-    dispatch_rdma_conn(c);
     return 0;
 }
 
+/***************************************************************************//**
+ * a worker's cm events
+ *
+ * Accepted ids live on the channel of their worker, so a disconnect is
+ * torn down on the thread that polls the qp and nothing else touches
+ * the conn meanwhile.
+ ******************************************************************************/
+void
+rdma_worker_cm_handler(int fd, short libevent_event, void *arg) {
+    LIBEVENT_THREAD *me = arg;
+    struct rdma_cm_event *cm_event = NULL;
+
+    while (0 == rdma_get_cm_event(me->cm_channel, &cm_event)) {
+        struct rdma_cm_id *id = cm_event->id;
+        enum rdma_cm_event_type type = cm_event->event;
+        conn *c = id->context;
+
+        if (settings.verbose > 0) {
+            fprintf(stderr, "RDMA CM event on worker %lu: %s\n",
+                    (unsigned long)me->thread_id, rdma_event_str(type));
+        }
+        rdma_ack_cm_event(cm_event);
+
+        switch (type) {
+            case RDMA_CM_EVENT_DISCONNECTED:
+            case RDMA_CM_EVENT_CONNECT_ERROR:
+            case RDMA_CM_EVENT_UNREACHABLE:
+                if (!c) {
+                    break;
+                }
+                if (settings.verbose > 0) {
+                    fprintf(stderr, "conn %p, recv msg: %d, post recv: %d, cqe %d\n\n",
+                            (void*)c, c->total_recv_msg, c->total_post_recv, c->total_cqe);
+                }
+                id->context = NULL;
+                rdma_conn_cleanup(c);
+                rdma_conn_free(c);
+                rdma_destroy_qp(id);
+                rdma_destroy_id(id);
+                break;
+
+            default:
+                break;
+        }
+    }
+}
+
 /***************************************************************************//**
  * poll handler for comlete channel
  *
@@ -6271,30 +7594,615 @@ cc_poll_event_handler(int fd, short libevent_event, void *arg) {
         ibv_ack_cq_events(cq, me->ack_events);
         me->ack_events = 0;
     }
+
+    pthread_mutex_lock(&me->stats.mutex);
+    me->stats.rdma_cq_wakeups++;
+    pthread_mutex_unlock(&me->stats.mutex);
+
+    /* leave the cq unarmed, the worker loop polls it until idle */
+    if (0 != rdma_spin_budget(me)) {
+        me->cq_polling = true;
+        rdma_poll_cq(me);
+        return;
+    }
+
     if (0 != ibv_req_notify_cq(cq, 0)) {
         perror("ibv_reg_notify_cq()");
         return;
     }
+    rdma_poll_cq(me);
+}
+
+/***************************************************************************//**
+ * unreliable datagram mode
+ *
+ ******************************************************************************/
+
+#define RDMA_UD_HDR_BYTES (RDMA_UD_SEND_WR * UDP_HEADER_SIZE)
+
+/* sent in place of a reply that would take more than half the send ring */
+static const char rdma_ud_too_large[] = "SERVER_ERROR reply too large for datagrams\r\n";
+
+/* what a received datagram's grh is overwritten with once its sender is known */
+typedef struct {
+    rdma_ud_ah_t    *ah;    /* one reference, NULL to drop the datagram */
+    uint32_t        qpn;
+} rdma_ud_src_t;
+
+static void
+rdma_ud_ah_put(rdma_ud_ah_t *ah) {
+    if (ah && 0 == --ah->refs) {
+        ibv_destroy_ah(ah->ah);
+        free(ah);
+    }
+}
+
+static void
+rdma_ud_destroy(rdma_ud_t *ud) {
+    if (ud->qp) {
+        ibv_destroy_qp(ud->qp);
+    }
+    if (ud->hdr_mr) {
+        ibv_dereg_mr(ud->hdr_mr);
+    }
+    free(ud->hdrs);
+    free(ud);
+}
+
+/* take a new or reset UD qp to RTS; rdma_cm answers SIDR with RDMA_UDP_QKEY */
+static int
+rdma_ud_qp_ready(rdma_ud_t *ud) {
+    struct ibv_qp_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = ud->port_num;
+    attr.qkey = RDMA_UDP_QKEY;
+    if (0 != ibv_modify_qp(ud->qp, &attr,
+                IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_QKEY)) {
+        perror("ibv_modify_qp(INIT)");
+        return -1;
+    }
+    attr.qp_state = IBV_QPS_RTR;
+    if (0 != ibv_modify_qp(ud->qp, &attr, IBV_QP_STATE)) {
+        perror("ibv_modify_qp(RTR)");
+        return -1;
+    }
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = 0;
+    if (0 != ibv_modify_qp(ud->qp, &attr, IBV_QP_STATE | IBV_QP_SQ_PSN)) {
+        perror("ibv_modify_qp(RTS)");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * The worker's UD qp and the conn its datagrams run through. Called on the
+ * worker for its first UD client; the qp shares the worker's cq and takes
+ * its receives from the UD class's srq. The conn is in the qp table before
+ * the qp can receive, so no datagram completes without it.
+ */
+static int
+rdma_ud_create(LIBEVENT_THREAD *thread, struct rdma_cm_id *id) {
+    rdma_recv_class_t *cls = &thread->recv_classes[RDMA_RECV_UD];
+    struct ibv_port_attr port_attr;
+    struct ibv_qp_init_attr init_attr;
+    rdma_ud_t *ud = NULL;
+    conn *c = NULL;
+    int mtu = 0;
+
+    if (0 != ibv_query_port(id->verbs, id->port_num, &port_attr)) {
+        perror("ibv_query_port()");
+        return -1;
+    }
+    mtu = 128 << port_attr.active_mtu;
+    if (mtu > RDMA_UD_MAX_MSG) {
+        mtu = RDMA_UD_MAX_MSG;
+    }
+
+    if ( !(ud = calloc(1, sizeof(rdma_ud_t))) ) {
+        fprintf(stderr, "out of memory in rdma_ud_create()\n");
+        return -1;
+    }
+    ud->port_num = id->port_num;
+    ud->payload = mtu - UDP_HEADER_SIZE;
+
+    /* the error text sits after the header slots, under the same mr */
+    if ( !(ud->hdrs = calloc(1, RDMA_UD_HDR_BYTES + sizeof(rdma_ud_too_large))) ) {
+        fprintf(stderr, "out of memory in rdma_ud_create()\n");
+        rdma_ud_destroy(ud);
+        return -1;
+    }
+    memcpy(ud->hdrs + RDMA_UD_HDR_BYTES, rdma_ud_too_large, sizeof(rdma_ud_too_large));
+    if ( !(ud->hdr_mr = ibv_reg_mr(thread->pd, ud->hdrs,
+                    RDMA_UD_HDR_BYTES + sizeof(rdma_ud_too_large), IBV_ACCESS_LOCAL_WRITE)) ) {
+        perror("ibv_reg_mr()");
+        rdma_ud_destroy(ud);
+        return -1;
+    }
+
+    memset(&init_attr, 0, sizeof(init_attr));
+    init_attr.qp_type = IBV_QPT_UD;
+    init_attr.qp_context = thread;
+    init_attr.sq_sig_all = 0;
+    init_attr.send_cq = thread->cq;
+    init_attr.recv_cq = thread->cq;
+    init_attr.srq = cls->srq;
+    init_attr.cap.max_send_wr = RDMA_UD_SEND_WR;
+    init_attr.cap.max_send_sge = RDMA_MAX_SEND_SGE;
+    init_attr.cap.max_recv_sge = 1;
+    if ( !(ud->qp = ibv_create_qp(thread->pd, &init_attr)) ) {
+        perror("ibv_create_qp()");
+        rdma_ud_destroy(ud);
+        return -1;
+    }
+
+    if ( !(c = rdma_conn_new(thread)) ) {
+        rdma_ud_destroy(ud);
+        return -1;
+    }
+    c->id = NULL;
+    c->qp = ud->qp;
+    c->ud = ud;
+    c->ud_ah = NULL;
+    c->credit_flow = false;
+    c->credits_held = 0;
+    c->rclass = cls;
+    c->srq = cls->srq;
+    c->rsize = cls->size;
+    c->max_inline = 0;
+    c->read_depth = 0;
+    ud->conn = c;
+
+    if (0 != rdma_conn_init(c, conn_new_cmd, DATA_BUFFER_SIZE, thread->base)
+        || 0 != rdma_ud_qp_ready(ud)) {
+        hashtable_delete(thread->qp_hash, ud->qp->qp_num);
+        rdma_conn_destroy(c);
+        rdma_ud_destroy(ud);
+        STATS_LOCK();
+        stats.curr_conns--;
+        STATS_UNLOCK();
+        return -1;
+    }
+    thread->ud = ud;
+
+    if (settings.verbose > 0) {
+        fprintf(stderr, "UD qp %u, %d bytes per datagram\n", ud->qp->qp_num, mtu);
+    }
+    return 0;
+}
+
+/*
+ * A SIDR request on the UD port, run on the worker the client is placed
+ * on: answer with its UD qp, made on first use. On failure the caller
+ * rejects; either way it destroys the id, which is not needed once the
+ * reply is out.
+ */
+int
+rdma_ud_accept(LIBEVENT_THREAD *thread, struct rdma_cm_id *id) {
+    struct rdma_conn_param conn_param;
+
+    if (0 == thread->recv_classes[RDMA_RECV_UD].count
+        || (!thread->ud && 0 != rdma_ud_create(thread, id))) {
+        return -1;
+    }
+
+    memset(&conn_param, 0, sizeof(conn_param));
+    conn_param.qp_num = thread->ud->qp->qp_num;
+    if (0 != rdma_accept(id, &conn_param)) {
+        perror("rdma_accept()");
+        return -1;
+    }
+
+    STATS_LOCK();
+    stats.rdma_ud_clients++;
+    STATS_UNLOCK();
+    return 0;
+}
+
+/*
+ * Called on each received datagram: find or make the address handle of
+ * its sender and leave it, referenced, where the grh was.
+ */
+static void
+rdma_ud_note_src(conn *c, struct ibv_wc *wc, struct ibv_mr *mr) {
+    rdma_ud_t *ud = c->ud;
+    struct ibv_grh *grh = mr->addr;
+    rdma_ud_src_t *src = mr->addr;
+    union ibv_gid gid;
+    uint32_t hv = 0;
+
+    memset(&gid, 0, sizeof(gid));
+    if (wc->wc_flags & IBV_WC_GRH) {
+        memcpy(&gid, &grh->sgid, sizeof(gid));
+    }
+    hv = hash(&gid, sizeof(gid)) ^ (wc->src_qp * 2654435761u) ^ wc->slid;
+
+    rdma_ud_peer_t *peer = &ud->peers[hv % RDMA_UD_AH_CACHE];
+    if (!peer->ah || peer->qpn != wc->src_qp || peer->lid != wc->slid
+        || 0 != memcmp(&peer->gid, &gid, sizeof(gid))) {
+        rdma_ud_ah_t *ah = malloc(sizeof(rdma_ud_ah_t));
+        if (!ah || !(ah->ah = ibv_create_ah_from_wc(c->pd, wc, grh, ud->port_num))) {
+            if (settings.verbose > 0) {
+                fprintf(stderr, "no address handle for UD qp %u\n", wc->src_qp);
+            }
+            free(ah);
+            src->ah = NULL;
+            return;
+        }
+        ah->refs = 1;
+
+        /* the old one lives on while replies or receives still use it */
+        rdma_ud_ah_put(peer->ah);
+        peer->ah = ah;
+        peer->qpn = wc->src_qp;
+        peer->lid = wc->slid;
+        peer->gid = gid;
+    }
+
+    peer->ah->refs++;
+    src->ah = peer->ah;
+    src->qpn = wc->src_qp;
+}
+
+/*
+ * Start on a received datagram: take over its sender and strip the grh
+ * and the frame header. Returns 0 when there are commands to parse;
+ * otherwise the datagram was dropped or answered and the state is set.
+ */
+static int
+rdma_ud_open_datagram(conn *c) {
+    rdma_ud_src_t *src = (rdma_ud_src_t *)c->rcurr;
+    unsigned char *hdr = (unsigned char *)c->rcurr + RDMA_UD_GRH;
+
+    rdma_ud_ah_put(c->ud_ah);
+    c->ud_ah = src->ah;
+    c->ud_qpn = src->qpn;
+
+    pthread_mutex_lock(&c->thread->stats.mutex);
+    c->thread->stats.rdma_ud_recvs++;
+    if (!c->ud_ah || c->rbytes < RDMA_UD_GRH + UDP_HEADER_SIZE) {
+        c->thread->stats.rdma_ud_drops++;
+    }
+    pthread_mutex_unlock(&c->thread->stats.mutex);
+
+    if (!c->ud_ah || c->rbytes < RDMA_UD_GRH + UDP_HEADER_SIZE) {
+        c->rbytes = 0;
+        conn_set_state(c, conn_new_cmd);
+        return -1;
+    }
+
+    c->request_id = hdr[0] * 256 + hdr[1];
+    c->rcurr += RDMA_UD_GRH + UDP_HEADER_SIZE;
+    c->rbytes -= RDMA_UD_GRH + UDP_HEADER_SIZE;
+
+    /* as on the UDP port, a request that spans datagrams is refused */
+    if (hdr[4] != 0 || hdr[5] != 1) {
+        c->rbytes = 0;
+        out_string(c, "SERVER_ERROR multi-packet request not supported");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Slices of the reply for one datagram, from *idx and *off on, into sg
+ * when it is not NULL. Returns the number of slices.
+ */
+static int
+rdma_ud_next_dgram(conn *c, int *idx, uint32_t *off, struct ibv_sge *sg) {
+    int room = c->ud->payload;
+    int n = 0;
+
+    while (room > 0 && *idx < c->sge_used && n < RDMA_MAX_SEND_SGE - 1) {
+        struct ibv_sge *s = &c->sge[*idx];
+        uint32_t take = s->length - *off;
+        if (take > (uint32_t)room) {
+            take = room;
+        }
+        if (sg) {
+            sg[n].addr = s->addr + *off;
+            sg[n].length = take;
+            sg[n].lkey = s->lkey;
+        }
+        n++;
+        room -= take;
+        *off += take;
+        if (*off == s->length) {
+            *idx += 1;
+            *off = 0;
+        }
+    }
+    return n;
+}
+
+/* datagrams the reply being built needs; an empty reply still takes one */
+static int
+rdma_ud_count_dgrams(conn *c) {
+    uint32_t off = 0;
+    int idx = 0, n = 0;
+
+    do {
+        rdma_ud_next_dgram(c, &idx, &off, NULL);
+        n++;
+    } while (idx < c->sge_used);
+    return n > RDMA_UD_SEND_WR / 2 ? 1 : n;
+}
+
+/*
+ * No room in the send ring for the reply. Replies are at most half the
+ * ring and every post that leaves more than half of it in flight is
+ * signaled, so a blocked conn always has a completion coming.
+ */
+static bool
+rdma_ud_blocked(conn *c) {
+    int need = rdma_ud_count_dgrams(c);
+    return c->ud->inflight > 0 && c->ud->inflight + need > RDMA_UD_SEND_WR;
+}
+
+/*
+ * Post the reply as ndgram datagrams, each a frame header from the send
+ * slot ring followed by slices of the reply. A reply too large for half
+ * the ring is replaced by an error. Returns 0 on success, -1 on failure.
+ */
+static int
+rdma_ud_post_reply(conn *c, uint32_t seq, int ndgram, bool signal) {
+    rdma_ud_t *ud = c->ud;
+    struct ibv_send_wr wrs[RDMA_UD_POST_BATCH], *bad = NULL;
+    struct ibv_sge sges[RDMA_UD_POST_BATCH][RDMA_MAX_SEND_SGE];
+    struct ibv_sge err_sge;
+    uint32_t off = 0;
+    int idx = 0, k = 0, n = 0;
+    bool truncate = false;
+
+    assert(c->ud_ah);
+    if (1 == ndgram && c->sge_used > 0) {
+        /* count_dgrams folds an oversized reply into one datagram */
+        rdma_ud_next_dgram(c, &idx, &off, NULL);
+        truncate = idx < c->sge_used;
+        idx = 0;
+        off = 0;
+    }
+    if (truncate) {
+        err_sge.addr = (uintptr_t)(ud->hdrs + RDMA_UD_HDR_BYTES);
+        err_sge.length = sizeof(rdma_ud_too_large) - 1;
+        err_sge.lkey = ud->hdr_mr->lkey;
+
+        pthread_mutex_lock(&c->thread->stats.mutex);
+        c->thread->stats.rdma_ud_drops++;
+        pthread_mutex_unlock(&c->thread->stats.mutex);
+    }
+
+    for (k = 0; k < ndgram; ++k) {
+        unsigned char *hdr = (unsigned char *)ud->hdrs
+            + (ud->next_hdr++ % RDMA_UD_SEND_WR) * UDP_HEADER_SIZE;
+        struct ibv_send_wr *wr = &wrs[n];
+        struct ibv_sge *sg = sges[n];
+
+        *hdr++ = c->request_id / 256;
+        *hdr++ = c->request_id % 256;
+        *hdr++ = k / 256;
+        *hdr++ = k % 256;
+        *hdr++ = ndgram / 256;
+        *hdr++ = ndgram % 256;
+        *hdr++ = 0;
+        *hdr++ = 0;
+
+        sg[0].addr = (uintptr_t)(hdr - UDP_HEADER_SIZE);
+        sg[0].length = UDP_HEADER_SIZE;
+        sg[0].lkey = ud->hdr_mr->lkey;
+
+        memset(wr, 0, sizeof(*wr));
+        wr->wr_id = seq;
+        wr->sg_list = sg;
+        if (truncate) {
+            sg[1] = err_sge;
+            wr->num_sge = 2;
+        } else {
+            wr->num_sge = 1 + rdma_ud_next_dgram(c, &idx, &off, sg + 1);
+        }
+        wr->opcode = IBV_WR_SEND;
+        wr->wr.ud.ah = c->ud_ah->ah;
+        wr->wr.ud.remote_qpn = c->ud_qpn;
+        wr->wr.ud.remote_qkey = RDMA_UDP_QKEY;
+        if (n > 0) {
+            wrs[n - 1].next = wr;
+        }
+        n++;
+
+        if (RDMA_UD_POST_BATCH == n || k == ndgram - 1) {
+            if (k == ndgram - 1 && signal) {
+                wr->send_flags = IBV_SEND_SIGNALED;
+            }
+            if (0 != ibv_post_send(ud->qp, wrs, &bad)) {
+                if (settings.verbose > 0) {
+                    perror("ibv_post_send()");
+                }
+                return -1;
+            }
+            n = 0;
+        }
+    }
+
+    pthread_mutex_lock(&c->thread->stats.mutex);
+    c->thread->stats.rdma_ud_sends += ndgram;
+    pthread_mutex_unlock(&c->thread->stats.mutex);
+    return 0;
+}
+
+/*
+ * Reset the worker's UD qp if it went to error. Sends it held are gone
+ * without completions, so their records are released here.
+ */
+void
+rdma_ud_recover(LIBEVENT_THREAD *me) {
+    rdma_ud_t *ud = me->ud;
+    struct ibv_qp_attr attr;
+    struct ibv_qp_init_attr init_attr;
+
+    if (!ud) {
+        return;
+    }
+    if (0 != ibv_query_qp(ud->qp, &attr, IBV_QP_STATE, &init_attr)) {
+        perror("ibv_query_qp()");
+        return;
+    }
+    if (IBV_QPS_ERR != attr.qp_state && IBV_QPS_SQE != attr.qp_state) {
+        return;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RESET;
+    if (0 != ibv_modify_qp(ud->qp, &attr, IBV_QP_STATE) || 0 != rdma_ud_qp_ready(ud)) {
+        fprintf(stderr, "UD qp %u could not be reset\n", ud->qp->qp_num);
+        return;
+    }
+    rdma_reclaim_sends(ud->conn, ud->conn->send_seq);
+
+    if (settings.verbose > 0) {
+        fprintf(stderr, "UD qp %u reset\n", ud->qp->qp_num);
+    }
+    STATS_LOCK();
+    stats.rdma_ud_qp_resets++;
+    STATS_UNLOCK();
+}
+
+/* the port's addressing changed: new datagrams make new address handles */
+void
+rdma_ud_forget_peers(LIBEVENT_THREAD *me) {
+    int i = 0;
+
+    if (!me->ud) {
+        return;
+    }
+    for (i = 0; i < RDMA_UD_AH_CACHE; ++i) {
+        rdma_ud_ah_put(me->ud->peers[i].ah);
+        me->ud->peers[i].ah = NULL;
+    }
+}
+
+/***************************************************************************//**
+ * busy polling
+ *
+ ******************************************************************************/
+uint64_t
+rdma_now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* how long to keep polling an idle cq before going back to events */
+static uint64_t
+rdma_spin_budget(LIBEVENT_THREAD *me) {
+    switch (rdma_context.poll_mode) {
+    case RDMA_POLL_BUSY:
+        return rdma_context.spin_usec;
+    case RDMA_POLL_ADAPTIVE:
+        if (0 == me->cq_gap_usec || me->cq_gap_usec * 2 > rdma_context.spin_usec) {
+            return 0;
+        }
+        return me->cq_gap_usec * 2;
+    default:
+        return 0;
+    }
+}
+
+/* fold completions into the rate placement sees, one sample per window */
+static void
+rdma_sample_cqe_rate(LIBEVENT_THREAD *me, int total) {
+    uint64_t now = rdma_now_usec();
+    uint64_t elapsed = now - me->load_window_usec;
+
+    me->load_window_cqes += total;
+    if (0 == me->load_window_usec || elapsed > 4 * RDMA_LOAD_WINDOW_USEC) {
+        /* first sample, or the worker was quiet: start over */
+        me->load_cqe_rate = 0;
+        me->load_window_usec = now;
+    } else if (elapsed >= RDMA_LOAD_WINDOW_USEC) {
+        uint32_t rate = (uint32_t)(me->load_window_cqes * 1000000ULL / elapsed);
+        me->load_cqe_rate = (me->load_cqe_rate + rate) / 2;
+        me->load_window_cqes = 0;
+        me->load_window_usec = now;
+    }
+}
+
+/* drain the cq; returns the number of completions handled */
+static int
+rdma_poll_cq(LIBEVENT_THREAD *me) {
+    int cqe = 0, i = 0, total = 0;
 
-    /* poll complete queue */
-    int cqe = 0, i = 0;
     do {
-        if ( (cqe = ibv_poll_cq(cq, rdma_context.poll_wc_size, me->poll_wc)) < 0) {
+        if ( (cqe = ibv_poll_cq(me->cq, rdma_context.poll_wc_size, me->poll_wc)) < 0) {
             perror("ibv_poll_cq()");
-            return;
+            return total;
         }
 
         conn *c = NULL;
         for (i = 0; i < cqe; ++i) {
             if ( !(c = hashtable_search(me->qp_hash, me->poll_wc[i].qp_num)) ) {
-                if (settings.verbose > 0) {
-                    fprintf(stderr, "hashtable_search() failed, return NULL.\n");
+                /* completions of a conn that is already gone */
+                if (settings.verbose > 1) {
+                    fprintf(stderr, "no conn for qp num %u\n", me->poll_wc[i].qp_num);
                 }
+                rdma_reclaim_stray_recv(me, (struct ibv_mr *)(uintptr_t)me->poll_wc[i].wr_id);
             } else {
                 rdma_drive_machine(me->poll_wc + i, c);
             }
         }
+        total += cqe;
+
+        /* give the receives consumed by this batch back in one post each */
+        rdma_flush_reposts(me);
     } while (cqe == rdma_context.poll_wc_size);
+
+    if (total > 0) {
+        rdma_sample_cqe_rate(me, total);
+    }
+    if (total > 0 && RDMA_POLL_EVENT != rdma_context.poll_mode) {
+        uint64_t now = rdma_now_usec();
+        if (0 != me->cq_last_usec) {
+            uint64_t gap = (now - me->cq_last_usec) / total;
+            me->cq_gap_usec = (me->cq_gap_usec * 7 + gap) / 8;
+        }
+        me->cq_last_usec = now;
+    }
+    return total;
+}
+
+/*
+ * One round of busy polling from the worker loop. Returns false once the
+ * cq has been idle for the spin budget and notification is re-armed.
+ */
+bool
+rdma_spin_cq(LIBEVENT_THREAD *me) {
+    if (rdma_poll_cq(me) > 0) {
+        return true;
+    }
+    me->cq_spins++;
+
+    if (rdma_now_usec() - me->cq_last_usec < rdma_spin_budget(me)) {
+        return true;
+    }
+
+    if (0 != ibv_req_notify_cq(me->cq, 0)) {
+        perror("ibv_reg_notify_cq()");
+        return true;
+    }
+    /* completions that arrived before the cq was armed raise no event */
+    if (rdma_poll_cq(me) > 0) {
+        return true;
+    }
+    me->cq_polling = false;
+
+    pthread_mutex_lock(&me->stats.mutex);
+    me->stats.rdma_cq_spins += me->cq_spins;
+    me->stats.rdma_cq_rearms++;
+    pthread_mutex_unlock(&me->stats.mutex);
+    me->cq_spins = 0;
+    return false;
 }
 
 /***************************************************************************//**
@@ -6336,36 +8244,135 @@ rdma_conn_init(conn *c, enum conn_states init_state,
 
     c->sge_used = 0;
     c->wmr_used = 0;
+    c->sbuf_used = 0;
 
     c->read_mr = NULL;
     c->read_size = 0;
+    c->read_total = 0;
+    c->read_posted = 0;
+    c->read_inflight = 0;
     
     c->remote_addr = 0;
     c->remote_rkey = 0;
 
-    c->write_ack_mr = NULL;
-
-    if (0 != hashtable_insert(c->thread->qp_hash, c->id->qp->qp_num, c)) {
+    c->send_seq = c->send_acked = 0;
+    c->unsignaled = 0;
+    c->send_wrs = 0;
+    c->end_dropped = false;
+    c->credit_update = false;
+    c->sent_sbufs = c->sent_wmrs = c->sent_items = c->sent_suffixes = 0;
+    c->sent_achunks = 0;
+    c->achunk_used = c->aused = 0;
+    c->send_parked = false;
+    c->shed = false;
+    c->failed = false;
+    c->cqe_mark = 0;
+    c->rmr = NULL;
+    c->pending_head = c->pending_count = 0;
+    c->recv_cmds = 0;
+    c->rcont = NULL;
+
+    c->total_cqe = 0;
+    c->total_recv_msg = 0;
+    c->total_post_recv = 0;
+
+    if (0 != hashtable_insert(c->thread->qp_hash, c->qp->qp_num, c)) {
         fprintf(stderr, "hashtable insert error!\n");
         return -1;
     }
 
-    // RDMA TODO: handle error 
-    if ( !(c->wmr = rdma_reg_msgs(c->id, c->wbuf, c->wsize)) ) {
-        perror("rdma_reg_msgs()");
-        return -1;
-    }
-
     return 0;
 }
 
-/***************************************************************************//**
- * RDAM drive machine
- ******************************************************************************/
-static void
-rdma_drive_machine(struct ibv_wc *wc, conn *c) {
-    struct ibv_mr *mr = (struct ibv_mr*)(uintptr_t)wc->wr_id;
-
+/*
+ * Keeps up to read_depth chunked RDMA READs of the value in flight, posted
+ * as one chain. They count against the send queue with the responses
+ * still posted; when it is full they wait for a send completion. The item
+ * is read in place when its memory is covered by the arena MR; otherwise
+ * it is registered once for the whole value.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+rdma_post_value_reads(conn *c) {
+    struct ibv_send_wr wrs[RDMA_READ_DEPTH], *bad = NULL;
+    struct ibv_sge sges[RDMA_READ_DEPTH];
+    uint32_t lkey = 0;
+    int n = 0;
+    /* the reads share the send queue with posted responses */
+    int room = RDMA_SEND_WR - c->send_wrs - c->read_inflight;
+
+    if (c->thread->arena_reads) {
+        lkey = c->thread->arena_mr->lkey;
+    } else {
+        if (!c->read_mr) {
+            if ( !(c->read_mr = rdma_reg_read(c->id, c->ritem, c->read_total)) ) {
+                return -1;
+            }
+            pthread_mutex_lock(&c->thread->stats.mutex);
+            c->thread->stats.rdma_reg_calls++;
+            pthread_mutex_unlock(&c->thread->stats.mutex);
+        }
+        lkey = c->read_mr->lkey;
+    }
+
+    while (c->read_inflight + n < c->read_depth && n < room
+           && c->read_posted < c->read_total) {
+        uint32_t len = c->read_total - c->read_posted;
+        if (len > RDMA_READ_CHUNK) {
+            len = RDMA_READ_CHUNK;
+        }
+
+        sges[n].addr = (uintptr_t)(c->ritem + c->read_posted);
+        sges[n].length = len;
+        sges[n].lkey = lkey;
+
+        memset(&wrs[n], 0, sizeof(wrs[n]));
+        wrs[n].wr_id = len;
+        wrs[n].sg_list = &sges[n];
+        wrs[n].num_sge = 1;
+        wrs[n].opcode = IBV_WR_RDMA_READ;
+        wrs[n].send_flags = IBV_SEND_SIGNALED;
+        wrs[n].wr.rdma.remote_addr = c->remote_addr + c->read_posted;
+        wrs[n].wr.rdma.rkey = c->remote_rkey;
+        if (n > 0) {
+            wrs[n - 1].next = &wrs[n];
+        }
+
+        c->read_posted += len;
+        n++;
+    }
+
+    if (0 == n) {
+        return 0;
+    }
+    if (0 != ibv_post_send(c->qp, wrs, &bad)) {
+        if (settings.verbose > 0) {
+            perror("ibv_post_send()");
+        }
+        return -1;
+    }
+    c->read_inflight += n;
+    __sync_add_and_fetch(&c->thread->load_wrs, n);
+
+    if (settings.verbose > 2) {
+        fprintf(stderr, "post %d reads, %u of %u bytes posted\n", n,
+                c->read_posted, c->read_total);
+    }
+
+    pthread_mutex_lock(&c->thread->stats.mutex);
+    c->thread->stats.rdma_read_chunks += n;
+    pthread_mutex_unlock(&c->thread->stats.mutex);
+    return 0;
+}
+
+/***************************************************************************//**
+ * RDAM drive machine
+ ******************************************************************************/
+static void
+rdma_drive_machine(struct ibv_wc *wc, conn *c) {
+    struct ibv_mr *mr = (struct ibv_mr*)(uintptr_t)wc->wr_id;
+
     if (settings.verbose > 2) {
         fprintf(stderr, "DRIVE MACHINE BEGIN: qp num in wc: %d\n", wc->qp_num);
     }
@@ -6375,136 +8382,182 @@ rdma_drive_machine(struct ibv_wc *wc, conn *c) {
         if (settings.verbose > 2) {
             fprintf(stderr, "bad wc [%d]\n", (int)wc->status);
         }
-        rdma_disconnect(c->id);
+        STATS_LOCK();
+        stats.rdma_error_completions++;
+        STATS_UNLOCK();
+
+        /* the opcode is undefined here; a receive caught in the flush is
+         * known by its buffer and goes back to the srq */
+        if (rdma_recv_class_owns(c->rclass, mr)) {
+            __sync_sub_and_fetch(&c->rclass->posted, 1);
+            rdma_queue_recv(c, mr);
+        }
+        if (c->ud) {
+            rdma_ud_recover(c->thread);
+        } else {
+            rdma_conn_fail(c);
+        }
         return;
     }
 
-    /* int     nreqs = settings.reqs_per_event; */
-    /* because of there must be only one request per event, so set it to 1. */
-    int     nreqs = 1;
-    int     i = 0;
+    int     nreqs = settings.reqs_per_event;
     bool    stop = false; 
+    bool    consumed = false;   /* wc has been acted on */
+    bool    yield = false;
+    int     ncmds = 0, nsends = 0, nsignaled = 0, ninline = 0, srq_empty = 0;
+
+    /* receives are taken in order once the conn is done with the previous one */
+    if (IBV_WC_RECV & wc->opcode) {
+        if (0 == __sync_sub_and_fetch(&c->rclass->posted, 1)) {
+            srq_empty = 1;
+        }
+        if (0 != rdma_stash_recv(c, mr, wc->byte_len)) {
+            if (settings.verbose > 0) {
+                fprintf(stderr, "id[%p] too many receives in flight\n", (void*)c->id);
+            }
+            /* the buffer goes back to the srq either way */
+            rdma_queue_recv(c, mr);
+            if (c->ud) {
+                /* a datagram the client will retry */
+                pthread_mutex_lock(&c->thread->stats.mutex);
+                c->thread->stats.rdma_ud_drops++;
+                pthread_mutex_unlock(&c->thread->stats.mutex);
+                return;
+            }
+            rdma_conn_fail(c);
+            return;
+        }
+        if (c->ud) {
+            rdma_ud_note_src(c, wc, mr);
+        } else if (c->credit_flow) {
+            rdma_credit_consume(c);
+        }
+        consumed = true;
+
+    /* have written data; the conn may have moved on since it was posted */
+    } else if (IBV_WC_SEND == wc->opcode || IBV_WC_RDMA_WRITE == wc->opcode) {
+        if (settings.verbose > 2) {
+            fprintf(stderr, "send %u complete\n", (uint32_t)wc->wr_id);
+        }
+        rdma_reclaim_sends(c, (uint32_t)wc->wr_id);
+        consumed = true;
+    }
 
     while (!stop) {
         switch (c->state) {
 
         case conn_waiting:
+            if (c->send_parked) {
+                if (c->send_acked != c->send_seq) {
+                    stop = true;
+                    break;
+                }
+                c->send_parked = false;
+                conn_set_state(c, c->resume_state);
+                break;
+            }
+
             /* have recieved data */
-            if (IBV_WC_RECV & wc->opcode) {
+            if (rdma_next_recv(c)) {
                 conn_set_state(c, conn_read);
                 break;
             }
 
-            switch (wc->opcode) {
-                /* have written data */
-                case IBV_WC_SEND:
-                    if (settings.verbose > 2) {
-                        fprintf(stderr, "use sge: %d\n", c->wmr_used);
-                    }
-                    
-                    if (0 != c->remote_addr && 0 != c->remote_rkey) {
-                        c->remote_addr = 0;
-                        c->remote_rkey = 0;
-                    }
-
-                    for (i = 0; i < c->wmr_used; ++i) {
-                        if (0 != rdma_dereg_mr(c->wmr_list[i])) {
-                            perror("rdma_dereg_mr()");
-                            conn_set_state(c, conn_closing);
-                            break;
-                        }
-                    }
-                    c->wmr_used = 0;
-                    c->sge_used = 0;
-                    c->wused = 0;
-
-                    if (c->write_state == conn_mwrite) {
-                        conn_release_items(c);
-                        conn_set_state(c, conn_new_cmd);
-                    } else if (c->write_state == conn_write) {
-                        if (c->write_and_free) {
-                            free(c->write_and_free);
-                            c->write_and_free = 0;
-                        }
-                        conn_set_state(c, c->write_and_go);
-                    } else {
-                        if (settings.verbose > 0)
-                            fprintf(stderr, "Unexpected state %d\n", c->state);
-                        conn_set_state(c, conn_closing);
-                    }
-                    break;
-
-                case IBV_WC_RDMA_WRITE:
-                    if (settings.verbose > 2) {
-                        fprintf(stderr, "rdma write operation achieve\r\n");
-                    }
-                    static char write_ack_buff[] = "END\r\n";
-                    if ( !c->write_ack_mr && !(c->write_ack_mr = rdma_reg_msgs(c->id, write_ack_buff, sizeof(write_ack_buff))) ) {
-                        if (settings.verbose > 2) {
-                            perror("ahieving write operation, rdma_reg_msgs()");
-                        }
-                        conn_set_state(c, conn_closing);
-                        break;
-                    }
-                    if (0 != rdma_post_send(c->id, c->write_ack_mr, c->write_ack_mr->addr, 
-                            c->write_ack_mr->length, c->write_ack_mr, 0)) {
-                        if (settings.verbose > 2) {
-                            perror("ahieving write operation, rdma_post_send()");
-                        }
-                        conn_set_state(c, conn_closing);
-                    }
-                    stop = true;
-                    break;
-                case IBV_WC_RDMA_READ:
-                    break;
-                default:
+            /* a client out of credits with no reply coming gets some back */
+            if (c->credit_flow && 0 == c->credits_held && 0 == c->sge_used
+                && !rdma_send_blocked(c) && !rdma_send_queue_full(c)) {
+                c->credit_update = true;
+                int posted = rdma_post_response(c, false);
+                c->credit_update = false;
+                if (posted < 0) {
+                    conn_set_state(c, conn_closing);
                     break;
+                }
+                nsends++;
+                ninline += posted;
+                if (0 == c->unsignaled) {
+                    nsignaled++;
+                }
+                pthread_mutex_lock(&c->thread->stats.mutex);
+                c->thread->stats.rdma_credit_updates++;
+                pthread_mutex_unlock(&c->thread->stats.mutex);
             }
 
+            stop = true;
             break;
 
         case conn_read:
-            if (IBV_WC_LOC_LEN_ERR == wc->status) {
-                conn_set_state(c, conn_closing);
-                break;
+            c->rcurr = c->rbuf = c->rmr->addr;
+            c->rbytes = c->rmr_len;
 
-            } else if (IBV_WC_SUCCESS != wc->status) {
-                /* RDMA TODO: do not execute! */
-                if (settings.verbose > 0) {
-                    fprintf(stderr, "id[%p] recv bad wc! status [%d]", (void*)c->id, wc->status);
-                } 
+            c->total_recv_msg += 1;
+            if ((settings.verbose > 1 && c->total_recv_msg % 10000 == 0) || settings.verbose > 2) {
+                fprintf(stderr, "%p recv_msg %d, post recv %d:\n%s\n", 
+                        (void*)c, c->total_recv_msg, c->total_post_recv, (char*)c->rbuf);
+            }
+
+            if (c->ud) {
+                if (0 != rdma_ud_open_datagram(c)) {
+                    break;
+                }
+            } else if (0 != rdma_parse_ctrl_hdr(c)) {
                 conn_set_state(c, conn_closing);
                 break;
+            }
 
-            } else {
-                c->rcurr = c->rbuf = mr->addr;
-                c->rbytes = wc->byte_len;
+            c->recv_cmds = 0;
+
+            conn_set_state(c, conn_parse_cmd);
+            break;
 
-                c->total_recv_msg += 1;
-                if ((settings.verbose > 1 && c->total_recv_msg % 10000 == 0) || settings.verbose > 2) {
-                    fprintf(stderr, "%p recv_msg %d, post recv %d:\n%s\n", 
-                            (void*)c, c->total_recv_msg, c->total_post_recv, (char*)c->rbuf);
+        case conn_new_cmd:
+            /* keep executing what is left of this receive, but hand the
+             * worker back after reqs_per_event commands if there are
+             * replies to send; the rest is parsed when the send completes */
+            if (c->rbytes > 0) {
+                c->cmd = -1;
+                c->substate = bin_no_state;
+                if (c->item) {
+                    item_remove(c->item);
+                    c->item = 0;
                 }
 
-                conn_set_state(c, conn_parse_cmd);
+                if (--nreqs < 0 && c->sge_used > 0) {
+                    if (settings.verbose > 2) {
+                        fprintf(stderr, "stop reading new command\n");
+                    }
+                    pthread_mutex_lock(&c->thread->stats.mutex);
+                    c->thread->stats.conn_yields++;
+                    pthread_mutex_unlock(&c->thread->stats.mutex);
+                    yield = true;
+                    conn_set_state(c, conn_mwrite);
+                } else {
+                    if (settings.verbose > 2) {
+                        fprintf(stderr, "continue reading new command\n");
+                    }
+                    conn_set_state(c, conn_parse_cmd);
+                }
                 break;
             }
 
-            break;
-
-        case conn_new_cmd:
-            nreqs--;
-            if (nreqs >= 0) {
-                /* do nothing */
-                if (settings.verbose > 2) {
-                    fprintf(stderr, "continue reading new command\n");
+            if (c->sge_used > 0) {
+                conn_set_state(c, conn_mwrite);
+            } else if (c->shed && c->send_seq == c->send_acked && 0 == c->pending_count) {
+                /* nothing received is left unanswered; the client
+                 * reconnects and is placed on a quieter worker */
+                if (settings.verbose > 0) {
+                    fprintf(stderr, "id[%p] closed to rebalance\n", (void*)c->id);
                 }
-                conn_set_state(c, conn_waiting);
+                STATS_LOCK();
+                stats.rdma_conns_shed++;
+                STATS_UNLOCK();
+                conn_set_state(c, conn_closing);
             } else {
-                if (settings.verbose > 2) {
-                    fprintf(stderr, "stop reading new command\n");
+                /* idle: give back lists a large multiget grew */
+                if (c->send_seq == c->send_acked) {
+                    rdma_conn_shrink(c);
                 }
-                stop = true;
+                conn_set_state(c, conn_waiting);
             }
             break;
 
@@ -6527,51 +8580,59 @@ rdma_drive_machine(struct ibv_wc *wc, conn *c) {
                 break;
             }
 
+            /* the next datagram may come from anyone */
+            if (c->ud && c->rlbytes > c->rbytes) {
+                item_remove(c->item);
+                c->item = 0;
+                c->rbytes = 0;
+                out_string(c, "SERVER_ERROR multi-packet request not supported");
+                break;
+            }
+
             if (0 != c->remote_addr && 0 != c->remote_rkey) {
-                if (!c->read_mr) {
-                    if ( !(c->read_mr = rdma_reg_read(c->id, c->ritem, c->rlbytes)) ) {
-                        conn_set_state(c, conn_closing);
-                        break;
-                    }
-                    if (0 != rdma_post_read(c->id, c->read_mr, 
-                                c->read_mr->addr, c->read_mr->length, c->read_mr, 
-                                IBV_SEND_SIGNALED, c->remote_addr, c->remote_rkey)) {
+                if (0 == c->read_total) {
+                    c->read_total = c->rlbytes;
+                    c->read_posted = 0;
+                    c->read_inflight = 0;
+                } else if (!consumed && IBV_WC_RDMA_READ == wc->opcode) {
+                    /* reads complete in order, wr_id holds the chunk length */
+                    consumed = true;
+                    c->read_inflight -= 1;
+                    __sync_sub_and_fetch(&c->thread->load_wrs, 1);
+                    c->rlbytes -= (int)wc->wr_id;
+                }
+
+                if (c->rlbytes > 0) {
+                    if (0 != rdma_post_value_reads(c)) {
                         conn_set_state(c, conn_closing);
                         break;
                     }
-                    if (settings.verbose > 2) {
-                        fprintf(stderr, "post read ok, rlbytes: %d\n", c->rlbytes);
-                    }
                     stop = true;
                     break;
+                }
 
-                } else {
-                    c->rlbytes -= wc->byte_len;
-                    if (c->rlbytes < 0) {
-                        c->rlbytes = 0;
-                    }
-                    if (settings.verbose > 2) {
-                        fprintf(stderr, "rdma read ok, rlbytes: %d, buff:\n%s\n", c->rlbytes, c->ritem);
-                    }
-                    if (settings.verbose > 2) {
-                        fprintf(stderr, "wc opcode: %d", (int)(wc->opcode));
-                    }
-                    if (0 != c->rlbytes) {
-                        conn_set_state(c, conn_closing);
-                    }
-
+                if (settings.verbose > 2) {
+                    fprintf(stderr, "rdma read of %u bytes done\n", c->read_total);
+                }
+                if (c->read_mr) {
                     rdma_dereg_mr(c->read_mr);
-                    /* clean the attribution */
                     c->read_mr = 0;
-                    c->remote_addr = 0;
-                    c->remote_rkey = 0;
-                    break;
                 }
+                c->ritem += c->read_total;
+                c->read_total = 0;
+                c->remote_addr = 0;
+                c->remote_rkey = 0;
+                break;
             }
 
             if (c->continue_nread) {
-                c->rcurr = c->rbuf = mr->addr;
-                c->rbytes = wc->byte_len;
+                if (!rdma_next_recv(c)) {
+                    /* wait for next recv */
+                    stop = true;
+                    break;
+                }
+                c->rcurr = c->rbuf = c->rmr->addr;
+                c->rbytes = c->rmr_len;
 
                 int tocopy = c->rbytes > c->rlbytes ? c->rlbytes : c->rbytes;
                 memcpy(c->ritem, c->rcurr, tocopy);
@@ -6581,7 +8642,6 @@ rdma_drive_machine(struct ibv_wc *wc, conn *c) {
                 c->rbytes -= tocopy;
                 if (c->rlbytes == 0) {
                     c->continue_nread = false;
-                    break;
                 }
             } else {
                 /* first check if we have leftovers in the conn_read buffer */
@@ -6605,108 +8665,677 @@ rdma_drive_machine(struct ibv_wc *wc, conn *c) {
                 }
                 c->continue_nread = true;
             }
-            /* wait for next recv */
-            stop = true;
+            break;
+
+        case conn_swallow:
+            /* we are reading sbytes and throwing them away */
+            if (c->sbytes == 0) {
+                conn_set_state(c, conn_new_cmd);
+                break;
+            }
+
+            /* first check if we have leftovers in the conn_read buffer */
+            if (c->rbytes > 0) {
+                int tocopy = c->rbytes > c->sbytes ? c->sbytes : c->rbytes;
+                c->sbytes -= tocopy;
+                c->rcurr += tocopy;
+                c->rbytes -= tocopy;
+                break;
+            }
+
+            if (c->ud) {
+                c->sbytes = 0;
+                break;
+            }
+            if (!rdma_next_recv(c)) {
+                stop = true;
+                break;
+            }
+            c->rcurr = c->rbuf = c->rmr->addr;
+            c->rbytes = c->rmr_len;
             break;
 
         case conn_write:
-            if (0 == c->sge_used) {
+            if (c->wbytes > 0) {
                 if (add_iov(c, c->wcurr, c->wbytes) != 0) {
                     if (settings.verbose > 0)
                         fprintf(stderr, "Couldn't build response\n");
                     conn_set_state(c, conn_closing);
                     break;
                 }
+                c->wbytes = 0;
             }
 
             /* fall through... */
 
         case conn_mwrite:
+            if (!yield && rdma_can_batch(c)) {
+                conn_set_state(c, conn_new_cmd);
+                break;
+            }
+
+            if (c->ud ? rdma_ud_blocked(c) : rdma_send_queue_full(c)) {
+                c->send_parked = true;
+                c->resume_state = c->state;
+                conn_set_state(c, conn_waiting);
+                break;
+            }
+
             c->write_state = c->state;
 
-            /*
-            if (0 != c->remote_addr && 0 != c->remote_rkey 
-                && 0 != rdma_post_writev(c->id, c->wmr, c->sge, c->sge_used, 
-                    IBV_SEND_SIGNALED, c->remote_addr, c->remote_rkey)) { 
-                if (settings.verbose > 2) {
-                    fprintf(stderr, "send post writev ok\n");
-                }
+            /* a yielding conn is resumed by the completion of this send */
+            int posted = rdma_post_response(c, yield);
+            if (posted < 0) {
                 conn_set_state(c, conn_closing);
+                break;
             }
-            */
+            nsends++;
+            ninline += posted;
+            if (0 == c->unsignaled) {
+                nsignaled++;
+            }
+
+            enum conn_states next = c->write_state == conn_write
+                ? c->write_and_go : conn_new_cmd;
+            if (yield) {
+                yield = false;
+                c->send_parked = true;
+                c->resume_state = next;
+                conn_set_state(c, conn_waiting);
+            } else {
+                conn_set_state(c, next);
+            }
+            break;
+
+        case conn_closing:
+            if (c->ud) {
+                /* only the datagram is at fault, the shared conn carries on */
+                if (c->item) {
+                    item_remove(c->item);
+                    c->item = 0;
+                }
+                c->rbytes = 0;
+                conn_set_state(c, conn_new_cmd);
+                break;
+            }
+            rdma_conn_fail(c);
+            stop = true;
+            break;
+
+        case conn_parse_cmd:
+            /* out of send window or arena chunks: wait until the posted sends
+             * complete, the last of them is signaled */
+            if (rdma_send_blocked(c)) {
+                c->send_parked = true;
+                c->resume_state = conn_parse_cmd;
+                conn_set_state(c, conn_waiting);
+                break;
+            }
+
+            if (try_read_command(c) == 0) {
+                /* wee need more data! send what the earlier commands produced */
+                conn_set_state(c, c->sge_used > 0 ? conn_mwrite : conn_waiting);
+            } else {
+                ncmds++;
+                c->recv_cmds++;
+            }
+
+            break;
+
+        default:
+            assert(0);
+            break;
+        }
+    }
+
+    /* the receive buffer goes back to the srq once nothing in it is pending */
+    if (c->rmr && c->rbytes <= 0) {
+        if (0 != rdma_repost_recv(c)) {
+            rdma_conn_fail(c);
+        }
+    }
+
+    pthread_mutex_lock(&c->thread->stats.mutex);
+    c->thread->stats.rdma_cqes++;
+    c->thread->stats.rdma_cmds += ncmds;
+    c->thread->stats.rdma_sends += nsends;
+    c->thread->stats.rdma_send_cqes += nsignaled;
+    c->thread->stats.rdma_inline_sends += ninline;
+    c->thread->stats.rdma_srq_empty += srq_empty;
+    pthread_mutex_unlock(&c->thread->stats.mutex);
+}
+
+/***************************************************************************//**
+ * receive bookkeeping
+ *
+ ******************************************************************************/
+static int
+rdma_stash_recv(conn *c, struct ibv_mr *mr, uint32_t len) {
+    if (c->pending_count == RDMA_PENDING_RECV) {
+        return -1;
+    }
+
+    int tail = (c->pending_head + c->pending_count) % RDMA_PENDING_RECV;
+    c->pending_mr[tail] = mr;
+    c->pending_len[tail] = len;
+    c->pending_count += 1;
+    return 0;
+}
+
+/* drop whatever is left of the current receive and move on to the next one */
+static bool
+rdma_next_recv(conn *c) {
+    if (0 == c->pending_count) {
+        return false;
+    }
+
+    if (0 != rdma_repost_recv(c)) {
+        conn_set_state(c, conn_closing);
+        return false;
+    }
+
+    c->rmr = c->pending_mr[c->pending_head];
+    c->rmr_len = c->pending_len[c->pending_head];
+    c->pending_head = (c->pending_head + 1) % RDMA_PENDING_RECV;
+    c->pending_count -= 1;
+    return true;
+}
+
+/* queue the current receive buffer for the worker's next chained repost */
+static int
+rdma_repost_recv(conn *c) {
+    struct ibv_mr *mr = c->rmr;
+
+    if (!mr) {
+        return 0;
+    }
+    c->rmr = NULL;
+    c->rbytes = 0;
+    return rdma_queue_recv(c, mr);
+}
+
+/* whether a completion's wr_id is one of the class's receive buffers */
+static bool
+rdma_recv_class_owns(rdma_recv_class_t *cls, struct ibv_mr *mr) {
+    int i = 0;
+
+    for (i = 0; i < cls->count; ++i) {
+        if (cls->mr_list[i] == mr) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int
+rdma_queue_recv(conn *c, struct ibv_mr *mr) {
+    c->total_post_recv += 1;
+    return rdma_requeue_recv(c->thread, c->rclass, mr);
+}
+
+/* batches a receive buffer for its class's srq */
+static int
+rdma_requeue_recv(LIBEVENT_THREAD *me, rdma_recv_class_t *cls, struct ibv_mr *mr) {
+    /* a failed flush left the batch full: post this one on its own */
+    if (RDMA_REPOST_BATCH == cls->nrepost) {
+        rdma_flush_reposts(me);
+        if (RDMA_REPOST_BATCH == cls->nrepost) {
+            struct ibv_sge sge = { (uintptr_t)mr->addr, mr->length, mr->lkey };
+            struct ibv_recv_wr wr, *bad = NULL;
+
+            memset(&wr, 0, sizeof(wr));
+            wr.wr_id = (uintptr_t)mr;
+            wr.sg_list = &sge;
+            wr.num_sge = 1;
+            if (0 != ibv_post_srq_recv(cls->srq, &wr, &bad)) {
+                if (settings.verbose > 0) {
+                    perror("ibv_post_srq_recv()");
+                }
+                return -1;
+            }
+            __sync_add_and_fetch(&cls->posted, 1);
+            return 0;
+        }
+    }
+
+    cls->repost_sge[cls->nrepost].addr = (uintptr_t)mr->addr;
+    cls->repost_sge[cls->nrepost].length = mr->length;
+    cls->repost_sge[cls->nrepost].lkey = mr->lkey;
+    cls->repost_wr[cls->nrepost].wr_id = (uintptr_t)mr;
+    cls->nrepost += 1;
+
+    if (RDMA_REPOST_BATCH == cls->nrepost) {
+        return rdma_flush_reposts(me);
+    }
+    return 0;
+}
+
+/*
+ * A completion whose qp has no conn any more. If it is one of the worker's
+ * receive buffers, known by its wr_id as for error completions, it goes
+ * back to its class rather than being lost to the srq.
+ */
+static void
+rdma_reclaim_stray_recv(LIBEVENT_THREAD *me, struct ibv_mr *mr) {
+    int i = 0;
+
+    for (i = 0; i < RDMA_RECV_CLASSES; ++i) {
+        rdma_recv_class_t *cls = &me->recv_classes[i];
+        if (cls->count > 0 && rdma_recv_class_owns(cls, mr)) {
+            __sync_sub_and_fetch(&cls->posted, 1);
+            rdma_requeue_recv(me, cls, mr);
+            return;
+        }
+    }
+}
+
+static int
+rdma_post_recv_now(conn *c, struct ibv_mr *mr) {
+    if (0 != rdma_post_recv(c->id, mr, mr->addr, mr->length, mr)) {
+        if (settings.verbose > 0) {
+            perror("rdma_post_recv()");
+        }
+        return -1;
+    }
+    __sync_add_and_fetch(&c->rclass->posted, 1);
+    return 0;
+}
+
+/* whether the reply just built can wait for the ones after it */
+static bool
+rdma_can_batch(conn *c) {
+    if (c->protocol != ascii_prot || c->rbytes <= 0 || c->write_and_free) {
+        return false;
+    }
+    if (c->state == conn_write && c->write_and_go != conn_new_cmd) {
+        return false;
+    }
+    return c->sge_used < RDMA_MAX_SEND_SGE / 2
+        && c->achunk_used < RDMA_ARENA_CONN_CHUNKS;
+}
+
+/* work requests the response being built takes on a connected qp */
+static int
+rdma_send_wr_count(conn *c) {
+    return c->sge_used > RDMA_MAX_SEND_SGE
+        ? (c->sge_used + RDMA_MAX_SEND_SGE - 1) / RDMA_MAX_SEND_SGE : 1;
+}
+
+/*
+ * No room in the send queue for the response. Every post that leaves more
+ * than half of it in flight is signaled, so there is a completion coming;
+ * value reads share the queue and are always signaled.
+ */
+static bool
+rdma_send_queue_full(conn *c) {
+    int inflight = c->send_wrs + c->read_inflight;
+
+    return inflight > 0 && inflight + rdma_send_wr_count(c) > RDMA_SEND_WR;
+}
+
+/* no room to build another response until posted ones complete */
+static bool
+rdma_send_blocked(conn *c) {
+    if (c->send_seq == c->send_acked) {
+        return false;
+    }
+    return c->send_seq - c->send_acked >= RDMA_SEND_WINDOW
+        || c->achunk_used == RDMA_ARENA_CONN_CHUNKS;
+}
+
+/***************************************************************************//**
+ * release what the responses up to seq held
+ *
+ ******************************************************************************/
+static void
+rdma_reclaim_sends(conn *c, uint32_t seq) {
+    uint32_t acked = c->send_acked;
+    int i = 0;
+
+    while (c->send_acked != c->send_seq && (int32_t)(seq - c->send_acked) > 0) {
+        c->send_acked += 1;
+        rdma_send_rec_t *rec = &c->send_recs[c->send_acked % RDMA_SEND_WINDOW];
+        assert(rec->seq == c->send_acked);
+        c->send_wrs -= rec->nwr;
+
+        for (i = 0; i < rec->nachunk; ++i) {
+            rdma_send_arena_put(c->thread, c->achunks[i]);
+        }
+        c->achunk_used -= rec->nachunk;
+        c->sent_achunks -= rec->nachunk;
+        memmove(c->achunks, c->achunks + rec->nachunk, sizeof(*c->achunks) * c->achunk_used);
+
+        for (i = 0; i < rec->nsbuf; ++i) {
+            rdma_send_pool_put(c->thread, c->sbuf_list[i]);
+        }
+        c->sbuf_used -= rec->nsbuf;
+        c->sent_sbufs -= rec->nsbuf;
+        memmove(c->sbuf_list, c->sbuf_list + rec->nsbuf, sizeof(*c->sbuf_list) * c->sbuf_used);
+
+        for (i = 0; i < rec->nwmr; ++i) {
+            if (0 != rdma_dereg_mr(c->wmr_list[i])) {
+                perror("rdma_dereg_mr()");
+            }
+        }
+        c->wmr_used -= rec->nwmr;
+        c->sent_wmrs -= rec->nwmr;
+        memmove(c->wmr_list, c->wmr_list + rec->nwmr, sizeof(*c->wmr_list) * c->wmr_used);
+
+        for (i = 0; i < rec->nitems; ++i) {
+            item_remove(c->ilist[i]);
+        }
+        c->ileft -= rec->nitems;
+        c->sent_items -= rec->nitems;
+        memmove(c->ilist, c->ilist + rec->nitems, sizeof(*c->ilist) * c->ileft);
+
+        for (i = 0; i < rec->nsuffix; ++i) {
+            cache_free(c->thread->suffix_cache, c->suffixlist[i]);
+        }
+        c->suffixleft -= rec->nsuffix;
+        c->sent_suffixes -= rec->nsuffix;
+        memmove(c->suffixlist, c->suffixlist + rec->nsuffix,
+                sizeof(*c->suffixlist) * c->suffixleft);
+
+        if (rec->item) {
+            item_remove(rec->item);
+        }
+        if (rec->write_and_free) {
+            free(rec->write_and_free);
+        }
+        if (rec->ud_ah) {
+            c->ud->inflight -= rec->ndgram;
+            rdma_ud_ah_put(rec->ud_ah);
+        }
+    }
+
+    if (acked != c->send_acked) {
+        __sync_sub_and_fetch(&c->thread->load_wrs, (int)(c->send_acked - acked));
+    }
+
+    /* an idle conn keeps no arena chunk */
+    if (c->send_acked == c->send_seq && 0 == c->sge_used) {
+        for (i = 0; i < c->achunk_used; ++i) {
+            rdma_send_arena_put(c->thread, c->achunks[i]);
+        }
+        c->achunk_used = 0;
+        c->aused = 0;
+    }
+}
+
+/***************************************************************************//**
+ * strip the RDMA control header from a freshly received buffer
+ *
+ * Returns 0 if there was no header or it was parsed, -1 if it is malformed.
+ ******************************************************************************/
+static int
+rdma_parse_ctrl_hdr(conn *c) {
+    if (c->rbytes <= 0) {
+        return 0;
+    }
+
+    if (RDMA_CTRL_MAGIC == (uint8_t)c->rcurr[0]) {
+        rdma_ctrl_hdr_t hdr;
+
+        if (c->rbytes < sizeof(hdr)) {
+            return -1;
+        }
+        /* receive buffers are page aligned, this is a straight copy */
+        memcpy(&hdr, c->rcurr, sizeof(hdr));
+        if (RDMA_CTRL_VERSION != hdr.version) {
+            if (settings.verbose > 0) {
+                fprintf(stderr, "unsupported control header version %d\n", hdr.version);
+            }
+            return -1;
+        }
+
+        c->remote_addr = ntohll(hdr.remote_addr);
+        c->remote_rkey = ntohl(hdr.rkey);
+        c->read_size = ntohl(hdr.length);
+        c->request_id = ntohl(hdr.request_id);
+
+        c->rcurr += sizeof(hdr);
+        c->rbytes -= sizeof(hdr);
+
+    } else if (HEAD_OPERATION == c->rcurr[0]) {
+        char *el = memchr(c->rcurr, '\n', c->rbytes);
+
+        if (!el || 3 != sscanf(c->rcurr + 2, "%lu %u %u\n",
+                    &c->remote_addr, &c->remote_rkey, &c->read_size)) {
+            return -1;
+        }
+
+        c->rbytes -= el + 1 - c->rcurr;
+        c->rcurr = el + 1;
+    } else {
+        return 0;
+    }
+
+    c->rbuf = c->rcurr;
+    if (settings.verbose > 2) {
+        fprintf(stderr, "AFTER READ RDMA HEADER:\n%.*s\n", c->rbytes, c->rbuf);
+    }
+    return 0;
+}
+
+/*
+ * The sends or writes a response on a connected qp takes, RDMA_MAX_SEND_SGE
+ * fragments each, chained into one post. Only the last is signaled and
+ * only the last write carries the immediate.
+ */
+static int
+rdma_post_send_wr(conn *c, uint32_t seq, uint32_t len, bool signal, bool inl) {
+    struct ibv_send_wr *wrs = c->thread->send_chain, *bad = NULL;
+    bool write = 0 != c->remote_addr && 0 != c->remote_rkey;
+    uint64_t remote_addr = c->remote_addr;
+    int credits = c->credit_flow ? rdma_credit_grant(c) : 0;
+    int nwr = rdma_send_wr_count(c);
+    int i = 0, j = 0;
+
+    for (i = 0; i < nwr; ++i) {
+        struct ibv_send_wr *wr = &wrs[i];
+        bool last = i == nwr - 1;
+
+        memset(wr, 0, sizeof(*wr));
+        wr->wr_id = seq;
+        wr->sg_list = c->sge + i * RDMA_MAX_SEND_SGE;
+        wr->num_sge = last ? c->sge_used - i * RDMA_MAX_SEND_SGE : RDMA_MAX_SEND_SGE;
+        wr->send_flags = (signal && last ? IBV_SEND_SIGNALED : 0) | (inl ? IBV_SEND_INLINE : 0);
+        wr->next = last ? NULL : &wrs[i + 1];
+
+        if (write) {
+            wr->opcode = last ? IBV_WR_RDMA_WRITE_WITH_IMM : IBV_WR_RDMA_WRITE;
+            wr->wr.rdma.remote_addr = remote_addr;
+            wr->wr.rdma.rkey = c->remote_rkey;
+            for (j = 0; j < wr->num_sge; ++j) {
+                remote_addr += wr->sg_list[j].length;
+            }
+        } else {
+            wr->opcode = last && c->credit_flow ? IBV_WR_SEND_WITH_IMM : IBV_WR_SEND;
+        }
+    }
+    if (c->credit_update) {
+        wrs[nwr - 1].imm_data = RDMA_IMM_CREDIT(RDMA_IMM_STATUS_CREDIT, credits, 0);
+    } else if (c->credit_flow) {
+        wrs[nwr - 1].imm_data = len > RDMA_IMM_CREDIT_LEN_MASK
+            ? RDMA_IMM_CREDIT(RDMA_IMM_STATUS_LONG, credits, RDMA_IMM_CREDIT_LEN_MASK)
+            : RDMA_IMM_CREDIT(RDMA_IMM_STATUS_OK, credits, len);
+    } else if (write) {
+        wrs[nwr - 1].imm_data = len > RDMA_IMM_LEN_MASK
+            ? RDMA_IMM(RDMA_IMM_STATUS_LONG, RDMA_IMM_LEN_MASK)
+            : RDMA_IMM(RDMA_IMM_STATUS_OK, len);
+    }
+
+    if (0 != ibv_post_send(c->qp, wrs, &bad)) {
+        if (settings.verbose > 0) {
+            perror("ibv_post_send()");
+        }
+        return -1;
+    }
 
-            if (0 != c->remote_addr && 0 != c->remote_rkey) {
-                if (0 != rdma_post_writev(c->id, c->wmr, c->sge, c->sge_used, 
-                                IBV_SEND_SIGNALED, c->remote_addr, c->remote_rkey)) { 
-                    conn_set_state(c, conn_closing);
-                }
-                if (settings.verbose > 2) {
-                    fprintf(stderr, "post writev ok! sge num:%d\n", c->sge_used);
-                }
-                conn_set_state(c, conn_waiting);
-                stop = true;
+    if (nwr > 1) {
+        pthread_mutex_lock(&c->thread->stats.mutex);
+        c->thread->stats.rdma_send_chains++;
+        pthread_mutex_unlock(&c->thread->stats.mutex);
+    }
 
-            } else if (0 != rdma_post_sendv(c->id, c->wmr, c->sge, c->sge_used, 0)) {
+    if (settings.verbose > 2) {
+        fprintf(stderr, "post %s %u%s%s ok! sge num:%d wr num:%d\n",
+                write ? "write with imm" : "send", seq,
+                signal ? " signaled" : "", inl ? " inline" : "", c->sge_used, nwr);
+    }
+    return 0;
+}
 
-                conn_set_state(c, conn_closing);
-            } else {
-                conn_set_state(c, conn_waiting);
-                stop = true;
-            }
-            break;
+/***************************************************************************//**
+ * post the response built in c->sge
+ *
+ * Clients that advertised a remote buffer get it as one RDMA WRITE with
+ * immediate data, everybody else as a SEND. Replies up to c->max_inline
+ * bytes are copied into the work request. The UD conn sends it as
+ * datagrams to the sender of the request.
+ *
+ * Returns 1 if it was sent inline, 0 if not, -1 on failure.
+ ******************************************************************************/
+static int
+rdma_post_response(conn *c, bool signal) {
+    uint32_t len = 0;
+    uint32_t seq = c->send_seq + 1;
+    rdma_send_rec_t *rec = &c->send_recs[seq % RDMA_SEND_WINDOW];
+    bool inl = false;
+    int i = 0, ndgram = 0, nwr = 0;
+
+    /* a reply split over several SENDs keeps its terminator */
+    if (!c->ud && c->end_dropped && c->sge_used > RDMA_MAX_SEND_SGE
+        && !(c->remote_addr && c->remote_rkey)
+        && 0 != rdma_append_sge(c, "END\r\n", 5, false)) {
+        return -1;
+    }
+    c->end_dropped = false;
 
-        case conn_closing:
-            rdma_disconnect(c->id);
-            stop = true;
-            break;
+    for (i = 0; i < c->sge_used; ++i) {
+        len += c->sge[i].length;
+    }
+    inl = !c->ud && len <= (uint32_t)c->max_inline;
 
-        case conn_parse_cmd:
-            if (HEAD_OPERATION == c->rbuf[0]) {
-                if (3 != sscanf(c->rbuf+2, "%lu %u %u\n", &c->remote_addr, &c->remote_rkey, &c->read_size)) {
-                    conn_set_state(c, conn_closing);
-                    break;
-                }
+    rec->seq = seq;
+    /* all arena chunks but the one being filled are done with after this;
+     * they may carry earlier replies, so inline sends retire them too */
+    rec->nachunk = c->achunk_used > 0 ? c->achunk_used - 1 - c->sent_achunks : 0;
+    if (inl) {
+        /* copied into the wqe, what it points to is released after posting */
+        rec->nsbuf = rec->nwmr = rec->nitems = rec->nsuffix = 0;
+        rec->item = NULL;
+        rec->write_and_free = NULL;
+    } else {
+        rec->nsbuf = c->sbuf_used - c->sent_sbufs;
+        rec->nwmr = c->wmr_used - c->sent_wmrs;
+        rec->nitems = c->ileft - c->sent_items;
+        rec->nsuffix = c->suffixleft - c->sent_suffixes;
+        rec->item = c->item;
+        rec->write_and_free = c->write_and_free;
+    }
+    rec->nwr = 0;
+    rec->ndgram = 0;
+    rec->ud_ah = NULL;
+    if (!c->ud) {
+        nwr = rdma_send_wr_count(c);
+        rec->nwr = nwr;
+    } else {
+        ndgram = rdma_ud_count_dgrams(c);
+        rec->ndgram = ndgram;
+        rec->ud_ah = c->ud_ah;
+        c->ud_ah->refs++;
+    }
+
+    /* ask for a completion when buffers have to come back soon, when the
+     * record holds items (a quiet conn would pin them indefinitely), when
+     * the window or the conn's arena chunks would be exhausted, and every
+     * signal_interval sends */
+    c->unsignaled += 1;
+    if (signal || rec->nsbuf > 0 || rec->nachunk > 0 || rec->nwmr > 0
+        || rec->nitems > 0 || rec->item || rec->nsuffix > 0
+        || rec->write_and_free
+        || seq - c->send_acked >= RDMA_SEND_WINDOW
+        || c->achunk_used == RDMA_ARENA_CONN_CHUNKS
+        || c->unsignaled >= rdma_context.signal_interval
+        || c->send_wrs + nwr > RDMA_SEND_WR / 2
+        || (c->ud && c->ud->inflight + ndgram > RDMA_UD_SEND_WR / 2)) {
+        signal = true;
+    }
+
+    if (c->ud) {
+        if (0 != rdma_ud_post_reply(c, seq, ndgram, signal)) {
+            rdma_ud_ah_put(rec->ud_ah);
+            rec->ud_ah = NULL;
+            return -1;
+        }
+        c->ud->inflight += ndgram;
+    } else if (0 != rdma_post_send_wr(c, seq, len, signal, inl)) {
+        return -1;
+    }
+    c->send_wrs += nwr;
 
-                while ('\n' != *c->rcurr && c->rcurr < c->rbuf + c->rbytes) {
-                    c->rcurr += 1;
-                }
-                if (c->rcurr < c->rbuf + c->rbytes && '\n' == *c->rcurr) {
-                    c->rcurr += 1;
-                    c->rbuf = c->rcurr;
-                    c->rbytes -= c->rcurr - c->rbuf;
+    if (inl) {
+        rdma_release_unsent(c);
+    }
 
-                    if (settings.verbose > 2) {
-                        fprintf(stderr, "AFTER READ RDMA HEADER:\n%s\n", c->rbuf);
-                    }
+    /* the remote buffer takes one response */
+    c->remote_addr = 0;
+    c->remote_rkey = 0;
 
-                } else {
-                    conn_set_state(c, conn_closing);
-                    break;
-                }
-            }
+    c->send_seq = seq;
+    __sync_add_and_fetch(&c->thread->load_wrs, 1);
+    c->sent_sbufs = c->sbuf_used;
+    c->sent_achunks += rec->nachunk;
+    c->sent_wmrs = c->wmr_used;
+    c->sent_items = c->ileft;
+    c->sent_suffixes = c->suffixleft;
+    c->item = 0;
+    c->write_and_free = 0;
+    c->sge_used = 0;
+    if (signal) {
+        c->unsignaled = 0;
+    }
+    return inl ? 1 : 0;
+}
 
-            if (try_read_command(c) == 0) {
-                /* wee need more data! */
-                conn_set_state(c, conn_waiting);
-            }
+/*
+ * Releases what the response just posted inline held beyond the arena:
+ * the tail of the conn lists that no send record owns.
+ */
+static void
+rdma_release_unsent(conn *c) {
+    int i = 0;
 
-            break;
+    for (i = c->sent_sbufs; i < c->sbuf_used; ++i) {
+        rdma_send_pool_put(c->thread, c->sbuf_list[i]);
+    }
+    c->sbuf_used = c->sent_sbufs;
 
-        default:
-            assert(0);
-            break;
+    for (i = c->sent_wmrs; i < c->wmr_used; ++i) {
+        if (0 != rdma_dereg_mr(c->wmr_list[i])) {
+            perror("rdma_dereg_mr()");
         }
     }
+    c->wmr_used = c->sent_wmrs;
 
-    if (IBV_WC_SUCCESS == wc->status && (IBV_WC_RECV & wc->opcode)) {
-        /* post a recv again to recv new message */
-        if (0 != rdma_post_recv(c->id, mr, mr->addr, mr->length, mr)) {
-            if (settings.verbose > 0) {
-                perror("rdma_post_recv()");
-            }
-            rdma_disconnect(c->id);
-        }
-        c->total_post_recv += 1;
+    for (i = c->sent_items; i < c->ileft; ++i) {
+        item_remove(c->ilist[i]);
+    }
+    c->ileft = c->sent_items;
+
+    for (i = c->sent_suffixes; i < c->suffixleft; ++i) {
+        cache_free(c->thread->suffix_cache, c->suffixlist[i]);
+    }
+    c->suffixleft = c->sent_suffixes;
+
+    if (c->item) {
+        item_remove(c->item);
+        c->item = 0;
+    }
+    if (c->write_and_free) {
+        free(c->write_and_free);
+        c->write_and_free = 0;
     }
 }
 
@@ -6717,8 +9346,20 @@ rdma_drive_machine(struct ibv_wc *wc, conn *c) {
 static void
 rdma_conn_cleanup(conn *c) {
 
+    rdma_reclaim_sends(c, c->send_seq);
     conn_release_items(c);
 
+    /* a value read that never finished */
+    if (c->read_mr) {
+        rdma_dereg_mr(c->read_mr);
+        c->read_mr = NULL;
+    }
+    c->read_total = 0;
+    if (c->read_inflight > 0) {
+        __sync_sub_and_fetch(&c->thread->load_wrs, c->read_inflight);
+        c->read_inflight = 0;
+    }
+
     if (c->write_and_free) {
         free(c->write_and_free);
         c->write_and_free = 0;
@@ -6739,6 +9380,20 @@ rdma_conn_cleanup(conn *c) {
     STATS_UNLOCK();
 }
 
+/*
+ * Frees a conn whose accept failed. It was counted by rdma_conn_new() but
+ * never reaches rdma_conn_cleanup(), which uncounts established ones.
+ */
+static void
+rdma_conn_abort(conn *c) {
+    c->id->context = NULL;
+    rdma_conn_free(c);
+
+    STATS_LOCK();
+    stats.curr_conns--;
+    STATS_UNLOCK();
+}
+
 /***************************************************************************//**
  * free conn
  *
@@ -6746,28 +9401,55 @@ rdma_conn_cleanup(conn *c) {
 static void
 rdma_conn_free(conn *c) {
     if (!c) return;
-    int i = 0;
 
-    hashtable_delete(c->thread->qp_hash, c->id->qp->qp_num);
+    if (c->qp) {
+        hashtable_delete(c->thread->qp_hash, c->qp->qp_num);
+        c->qp = NULL;
+    }
+
+    rdma_release_send_bufs(c);
 
-    if ( (c->wmr && 0 != rdma_dereg_mr(c->wmr)) ||
-         (c->write_ack_mr && 0 != rdma_dereg_mr(c->write_ack_mr)) ) {
-        perror("rdma_dereg_mr() in rdma_conn_free()");
+    if (c->credit_flow) {
+        __sync_sub_and_fetch(&c->rclass->credits_out, c->credits_held);
+        c->credits_held = 0;
     }
-    if (c->wmr_list) {
-        for (i = 0; i < c->wmr_used; ++i) if (c->wmr_list[i]) {
-            if (0 != rdma_dereg_mr(c->wmr_list[i])) {
-                perror("rdma_dereg_mr() in rdma_conn_free()");
-            }
-        }
+
+    /* receive buffers belong to the class's srq; this runs outside the
+     * cq poll, so they are posted directly rather than batched */
+    if (c->rmr) {
+        rdma_post_recv_now(c, c->rmr);
+        c->rmr = NULL;
     }
+    while (c->pending_count > 0) {
+        rdma_post_recv_now(c, c->pending_mr[c->pending_head]);
+        c->pending_head = (c->pending_head + 1) % RDMA_PENDING_RECV;
+        c->pending_count -= 1;
+    }
+
+    /* keep it for the next connect on this worker */
+    LIBEVENT_THREAD *thread = c->thread;
+    __sync_sub_and_fetch(&thread->load_conns, 1);
+    rdma_conn_shrink(c);
+    pthread_mutex_lock(&thread->conn_pool_lock);
+    if (thread->conn_pool_count < rdma_context.conn_pool_max) {
+        c->next = thread->conn_pool;
+        thread->conn_pool = c;
+        thread->conn_pool_count++;
+        c = NULL;
+    }
+    pthread_mutex_unlock(&thread->conn_pool_lock);
+
+    if (c) {
+        rdma_conn_destroy(c);
+    }
+}
 
+static void
+rdma_conn_destroy(conn *c) {
     if (c->hdrbuf)
         free(c->hdrbuf);
     if (c->msglist)
         free(c->msglist);
-    /* if (c->rbuf)
-        free(c->rbuf); */
     if (c->wbuf)
         free(c->wbuf);
     if (c->ilist)
@@ -6781,148 +9463,417 @@ rdma_conn_free(conn *c) {
         free(c->sge);
     if (c->wmr_list)
         free(c->wmr_list);
-
+    if (c->sbuf_list)
+        free(c->sbuf_list);
 
     free(c);
 }
 
+/*
+ * Like conn_shrink(): give back lists that grew past their high-water
+ * mark once nothing is queued in them.
+ */
+static void
+rdma_conn_shrink(conn *c) {
+    if (c->isize > ITEM_LIST_HIGHWAT && 0 == c->ileft) {
+        item **newbuf = realloc(c->ilist, ITEM_LIST_INITIAL * sizeof(c->ilist[0]));
+        if (newbuf) {
+            c->ilist = newbuf;
+            c->isize = ITEM_LIST_INITIAL;
+        }
+    }
+
+    if (c->msgsize > MSG_LIST_HIGHWAT) {
+        struct msghdr *newbuf = realloc(c->msglist, MSG_LIST_INITIAL * sizeof(c->msglist[0]));
+        if (newbuf) {
+            c->msglist = newbuf;
+            c->msgsize = MSG_LIST_INITIAL;
+        }
+    }
+
+    if (c->sge_size > RDMA_SGE_LIST_HIGHWAT && 0 == c->sge_used) {
+        struct ibv_sge *newbuf = realloc(c->sge, RDMA_SGE_LIST_INITIAL * sizeof(c->sge[0]));
+        if (newbuf) {
+            c->sge = newbuf;
+            c->sge_size = RDMA_SGE_LIST_INITIAL;
+        }
+    }
+
+    if (c->wmr_size > RDMA_SGE_LIST_HIGHWAT && 0 == c->wmr_used) {
+        struct ibv_mr **newbuf = realloc(c->wmr_list, RDMA_SGE_LIST_INITIAL * sizeof(c->wmr_list[0]));
+        if (newbuf) {
+            c->wmr_list = newbuf;
+            c->wmr_size = RDMA_SGE_LIST_INITIAL;
+        }
+    }
+
+    if (c->sbuf_size > RDMA_SGE_LIST_HIGHWAT && 0 == c->sbuf_used) {
+        rdma_sbuf_t **newbuf = realloc(c->sbuf_list, RDMA_SGE_LIST_INITIAL * sizeof(c->sbuf_list[0]));
+        if (newbuf) {
+            c->sbuf_list = newbuf;
+            c->sbuf_size = RDMA_SGE_LIST_INITIAL;
+        }
+    }
+}
+
 /***************************************************************************//**
- * simple hash table for reusing memory
+ * remote index maintenance
  *
+ * Must be called with the item lock for hv held. Slots are selected with
+ * at least as many bits as the item lock table, so all writers of a slot
+ * hold the same lock.
  ******************************************************************************/
+static void
+rdma_rindex_publish(item *it, const uint32_t hv) {
+    if (!rdma_context.rindex) return;
+
+    /* key, suffix and data are contiguous after the CAS word */
+    uint32_t len = it->nkey + 1 + it->nsuffix + it->nbytes;
 
-size_t calc_hash(hashtable_t *h, int32_t key) {
-    return key % h->size;
+    /* a counter's data is only its slot, it must be read with a GET */
+    if ((it->it_flags & ITEM_COUNTER) || len > RDMA_RINDEX_DATA) {
+        rdma_rindex_retract(hv);
+        return;
+    }
+
+    uint32_t index = hv & ((1U << rdma_context.rindex_power) - 1);
+    rdma_rindex_slot_t *slot = rdma_context.rindex + index;
+    char *copy = rdma_context.rindex_data + (size_t)index * RDMA_RINDEX_DATA;
+
+    slot->seq += 1;
+    __sync_synchronize();
+
+    slot->hv = hv;
+    slot->len = len;
+    slot->addr = (uintptr_t)copy;
+    slot->cas = ITEM_get_cas(it);
+    slot->csum = hash(ITEM_data(it), it->nbytes);
+    memcpy(copy, ITEM_key(it), len);
+
+    __sync_synchronize();
+    slot->seq += 1;
 }
 
-hashtable_t* hashtable_create(size_t size) {
-    /* book proper size, if size is too large, just return NULL */
-    const static int kPrime[4] = {1543, 3079, 6151, 12289};
+static void
+rdma_rindex_retract(const uint32_t hv) {
+    if (!rdma_context.rindex) return;
 
-    size = size * 3 / 2;
-    if (size > kPrime[3]) {
-        fprintf(stderr, "the size of hashtable is too large\n");
-        return NULL;
+    rdma_rindex_slot_t *slot = rdma_context.rindex
+        + (hv & ((1U << rdma_context.rindex_power) - 1));
+
+    if (slot->hv != hv || 0 == slot->addr) return;
+
+    slot->seq += 1;
+    __sync_synchronize();
+    slot->addr = 0;
+    slot->len = 0;
+    __sync_synchronize();
+    slot->seq += 1;
+}
+
+/***************************************************************************//**
+ * remote-atomic counters
+ *
+ * A key's slot is one of RDMA_COUNTER_PROBES that share the low 13 bits of
+ * its hash. The item lock table is at most 2^13 wide, so like the remote
+ * index every writer of a slot holds the same item lock, and a slot is free
+ * once the item recorded for it no longer holds it.
+ ******************************************************************************/
+static uint32_t
+rdma_counter_slot(item *it) {
+    uint32_t slot;
+
+    memcpy(&slot, ITEM_data(it), sizeof(slot));
+    return slot;
+}
+
+static bool
+rdma_counter_held(const uint32_t slot) {
+    item *it = rdma_context.counter_owners[slot];
+
+    /* the item may have been freed and reused since, but never unmapped */
+    return it != NULL
+        && (it->it_flags & (ITEM_LINKED | ITEM_COUNTER)) == (ITEM_LINKED | ITEM_COUNTER)
+        && rdma_counter_slot(it) == slot;
+}
+
+/* Must be called with the item lock for hv held, before it is linked. */
+static bool
+rdma_counter_claim(item *it, const uint32_t hv, uint32_t *slot) {
+    uint32_t mask = (1U << rdma_context.counters_power) - 1;
+    int i;
+
+    for (i = 0; i < RDMA_COUNTER_PROBES; i++) {
+        uint32_t s = (hv + ((uint32_t)i << 13)) & mask;
+        if (!rdma_counter_held(s)) {
+            memcpy(ITEM_data(it), &s, sizeof(s));
+            it->it_flags |= ITEM_COUNTER;
+            rdma_context.counter_owners[s] = it;
+            *slot = s;
+            return true;
+        }
     }
+    return false;
+}
 
-    int i = 0;
-    for (i = 0; i < 4; ++i) if (size <= kPrime[i]) {
-        size = kPrime[i];
-        break;
+/* Returns the new value; decrements stop at 0 like do_add_delta(). */
+static uint64_t
+rdma_counter_add(item *it, const bool incr, const uint64_t delta) {
+    volatile uint64_t *value = rdma_context.counters + rdma_counter_slot(it);
+    uint64_t old, new;
+
+    if (incr) {
+        return __sync_add_and_fetch(value, delta);
+    }
+    do {
+        old = *value;
+        new = delta > old ? 0 : old - delta;
+    } while (!__sync_bool_compare_and_swap(value, old, new));
+    return new;
+}
+
+/*
+ * Renders a counter's value as 20 space-padded digits and "\r\n", the way
+ * an in-place incr leaves a value, into a suffix buffer stored at *si, and
+ * adds the first len bytes of it to the response.
+ */
+static int
+rdma_counter_add_iov(conn *c, item *it, int *si, const int len) {
+    char *buf;
+
+    if (*si >= c->suffixsize) {
+        char **new_suffix_list = realloc(c->suffixlist,
+                                         sizeof(char *) * c->suffixsize * 2);
+        if (!new_suffix_list) {
+            STATS_LOCK();
+            stats.malloc_fails++;
+            STATS_UNLOCK();
+            return -1;
+        }
+        c->suffixsize *= 2;
+        c->suffixlist = new_suffix_list;
+    }
+
+    if (!(buf = cache_alloc(c->thread->suffix_cache))) {
+        STATS_LOCK();
+        stats.malloc_fails++;
+        STATS_UNLOCK();
+        return -1;
     }
+    *(c->suffixlist + *si) = buf;
+    (*si)++;
+
+    snprintf(buf, SUFFIX_SIZE, "%-20llu\r\n",
+             (unsigned long long)rdma_context.counters[rdma_counter_slot(it)]);
+    return add_iov(c, buf, len);
+}
+
+/***************************************************************************//**
+ * qp_num to conn table
+ *
+ * Open addressing with linear probing over a power of two array, kept at
+ * most half full, growing without bound. Only the owning worker uses it:
+ * conns are accepted, polled and torn down on their worker. Searches on
+ * the poll path go without locking; inserts, deletes, rehashes and the
+ * walks that shed or fail conns take the lock, which is uncontended.
+ * Deleted slots become tombstones and are dropped at the next rehash.
+ ******************************************************************************/
 
-    /* allocate memory */
+#define HASHTABLE_TOMBSTONE ((void*)1)
+
+static inline size_t
+hashtable_slot(const hashtable_t *h, uint32_t key) {
+    return (size_t)((key * 2654435761U) >> (32 - h->power));
+}
+
+hashtable_t* hashtable_create(size_t size) {
     hashtable_t *h = calloc(1, sizeof(hashtable_t));
     if (!h) {
         fprintf(stderr, "out of memory in hashtable_create()\n");
         return NULL;
     }
 
-    h->size = size;
-    h->T = calloc(h->size, sizeof(hash_item_t));
+    h->power = 4;
+    while (((size_t)1 << h->power) < size * 2 && h->power < 31) {
+        h->power++;
+    }
+    h->mask = ((size_t)1 << h->power) - 1;
+
+    h->T = calloc(h->mask + 1, sizeof(hash_item_t));
     if (!h->T) {
         free(h);
         fprintf(stderr, "out of memory in hashtable_create()\n");
         return NULL;
     }
+    pthread_mutex_init(&h->lock, NULL);
     
     return h;
 }
 
 void hashtable_free(hashtable_t *h) {
     if (h) {
-        size_t i = 0;
-        hash_item_t *iter = NULL;
-        hash_item_t *temp = NULL;
-
-        for (i = 0; i < h->size; ++i) {
-            iter = h->T[i].next;
-            while (iter) {
-                temp = iter;
-                iter = iter->next;
-                free(temp);
-            }
-        }
+        pthread_mutex_destroy(&h->lock);
         free(h->T);
         free(h);
     }
 }
 
-int hashtable_insert(hashtable_t *h, int32_t key, void *p) {
-    size_t hashv = calc_hash(h, key);
-    hash_item_t *item = h->T + hashv;
-
-    if (!item->p) {
-        item->key = key;
-        item->p = p;
-        return 0;
+/* rebuild without tombstones, doubling if live entries need it */
+static int hashtable_rehash(hashtable_t *h) {
+    unsigned int power = h->power;
+    size_t i = 0;
 
-    } else {
-        hash_item_t *new_item = calloc(1, sizeof(hash_item_t));
-        if (!new_item) {
-            fprintf(stderr, "out of memory in hashtable_insert()\n");
-            return -1;
-        }
+    if ((h->count + 1) * 4 > h->mask + 1) {
+        power++;
+    }
+    if (power > 31) {
+        fprintf(stderr, "hashtable is full\n");
+        return -1;
+    }
 
-        new_item->key = key;
-        new_item->p = p;
+    hash_item_t *T = calloc((size_t)1 << power, sizeof(hash_item_t));
+    if (!T) {
+        fprintf(stderr, "out of memory in hashtable_insert()\n");
+        return -1;
+    }
 
-        new_item->next = item->next;
-        item->next = new_item;
-        return 0;
+    hash_item_t *old = h->T;
+    size_t old_size = h->mask + 1;
+    h->power = power;
+    h->mask = ((size_t)1 << power) - 1;
+    for (i = 0; i < old_size; ++i) {
+        if (old[i].p && old[i].p != HASHTABLE_TOMBSTONE) {
+            size_t j = hashtable_slot(h, old[i].key);
+            while (T[j].p) {
+                j = (j + 1) & h->mask;
+            }
+            T[j] = old[i];
+        }
     }
+    h->T = T;
+    h->tombstones = 0;
+    free(old);
+    return 0;
 }
 
-void *hashtable_search(hashtable_t *h, int32_t key) {
-    size_t hashv = calc_hash(h, key);
-    hash_item_t *iter = h->T + hashv;
+int hashtable_insert(hashtable_t *h, uint32_t key, void *p) {
+    int ret = 0;
 
-    if (key == 0 && settings.verbose > 0) {
-        fprintf(stderr, "in hashtable_search, the key == 0\n");
+    pthread_mutex_lock(&h->lock);
+    if ((h->count + h->tombstones + 1) * 2 > h->mask + 1) {
+        ret = hashtable_rehash(h);
     }
 
-    while (iter) {
-        if (iter->key == key) {
-            return iter->p;
+    if (0 == ret) {
+        size_t i = hashtable_slot(h, key);
+        hash_item_t *slot = NULL;
+
+        while (h->T[i].p) {
+            if (h->T[i].p == HASHTABLE_TOMBSTONE) {
+                if (!slot) slot = &h->T[i];
+            } else if (h->T[i].key == key) {
+                /* qp numbers are reused */
+                slot = &h->T[i];
+                break;
+            }
+            i = (i + 1) & h->mask;
         }
-        iter = iter->next;
-    }
 
-    if (settings.verbose > 0) {
-        fprintf(stderr, "in hashtable_search, didn't find such key, %d\n", key);
+        if (!slot) {
+            slot = &h->T[i];
+            h->count++;
+        } else if (slot->p == HASHTABLE_TOMBSTONE) {
+            h->tombstones--;
+            h->count++;
+        }
+        slot->key = key;
+        slot->p = p;
     }
-    return NULL;
+    pthread_mutex_unlock(&h->lock);
+    return ret;
 }
 
-void hashtable_delete(hashtable_t *h, int32_t key) {
-    size_t hashv = calc_hash(h, key);
-    hash_item_t *item = h->T + hashv;
-
-    if (!item->p) return;
-    
-    if (key == item->key) {
-        if (item->next) {
-            hash_item_t *temp = item->next;
-            item->next = temp->next;
-            item->key = temp->key;
-            item->p = temp->p;
-            free(temp);
+void *hashtable_search(hashtable_t *h, uint32_t key) {
+    size_t i = hashtable_slot(h, key);
 
-        } else {
-            item->key = 0;
-            item->p = NULL;
+    while (h->T[i].p) {
+        if (h->T[i].key == key && h->T[i].p != HASHTABLE_TOMBSTONE) {
+            return h->T[i].p;
         }
+        i = (i + 1) & h->mask;
+    }
+    return NULL;
+}
 
-    } else {
-        hash_item_t *iter = item;
-        while (iter->next) {
-            if (iter->next->key == key) {
-                hash_item_t *temp = iter->next;
-                iter->next = temp->next;
-                free(temp);
+/*
+ * Flag the conn with the most completions since the last call. Runs on
+ * the worker, the only thread that frees its conns, so every conn found
+ * in the table is valid.
+ */
+void
+rdma_shed_busiest_conn(LIBEVENT_THREAD *me) {
+    hashtable_t *h = me->qp_hash;
+    conn *busiest = NULL;
+    int most = -1;
+    size_t i = 0;
+
+    pthread_mutex_lock(&h->lock);
+    if (h->count > 1) {
+        for (i = 0; i <= h->mask; ++i) {
+            conn *c = h->T[i].p;
+            if (!c || HASHTABLE_TOMBSTONE == (void*)c || c->ud) {
+                continue;
+            }
+            if (c->total_cqe - c->cqe_mark > most && !c->shed) {
+                most = c->total_cqe - c->cqe_mark;
+                busiest = c;
             }
-            iter = iter->next;
+            c->cqe_mark = c->total_cqe;
+        }
+        if (busiest) {
+            busiest->shed = true;
+        }
+    }
+    pthread_mutex_unlock(&h->lock);
+}
+
+/*
+ * The worker's cq failed and its qps with it. Every connected client is
+ * disconnected so it reconnects to a worker that still works.
+ */
+void
+rdma_fail_worker(LIBEVENT_THREAD *me) {
+    hashtable_t *h = me->qp_hash;
+    int n = 0;
+    size_t i = 0;
+
+    pthread_mutex_lock(&h->lock);
+    for (i = 0; i <= h->mask; ++i) {
+        conn *c = h->T[i].p;
+        if (!c || HASHTABLE_TOMBSTONE == (void*)c || c->ud || c->failed) {
+            continue;
         }
+        rdma_conn_fail(c);
+        n++;
     }
+    pthread_mutex_unlock(&h->lock);
+
+    fprintf(stderr, "RDMA worker %lu: cq failed, %d conns disconnected\n",
+            (unsigned long)me->thread_id, n);
 }
 
+void hashtable_delete(hashtable_t *h, uint32_t key) {
+    pthread_mutex_lock(&h->lock);
+    size_t i = hashtable_slot(h, key);
+
+    while (h->T[i].p) {
+        if (h->T[i].key == key && h->T[i].p != HASHTABLE_TOMBSTONE) {
+            h->T[i].p = HASHTABLE_TOMBSTONE;
+            h->count--;
+            h->tombstones++;
+            break;
+        }
+        i = (i + 1) & h->mask;
+    }
+    pthread_mutex_unlock(&h->lock);
+}
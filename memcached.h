@@ -59,6 +59,10 @@
 #define IOV_LIST_HIGHWAT 600
 #define MSG_LIST_HIGHWAT 100
 
+/* Initial and high-water sizes of the RDMA sge and send buffer lists */
+#define RDMA_SGE_LIST_INITIAL 32
+#define RDMA_SGE_LIST_HIGHWAT 256
+
 /* Binary protocol stuff */
 #define MIN_BIN_PKT_LENGTH 16
 #define BIN_PKT_HDR_WORDS (MIN_BIN_PKT_LENGTH/sizeof(uint32_t))
@@ -215,7 +219,8 @@ enum store_item_type {
 };
 
 enum delta_result_type {
-    OK, NON_NUMERIC, EOM, DELTA_ITEM_NOT_FOUND, DELTA_ITEM_CAS_MISMATCH
+    OK, NON_NUMERIC, EOM, DELTA_ITEM_NOT_FOUND, DELTA_ITEM_CAS_MISMATCH,
+    DELTA_ITEM_REMOTE_ONLY
 };
 
 /** Time relative to server start. Smaller than time_t on 64-bit systems. */
@@ -233,6 +238,68 @@ struct slab_stats {
     uint64_t  decr_hits;
 };
 
+/**
+ * Receive buffers come in size classes, each posted to its own SRQ. A conn
+ * is attached to one class for its lifetime: clients pass rdma_conn_req_t
+ * as connect private data with the largest message they will send and get
+ * the smallest class that holds it, others get the large class (-K, -Y).
+ * Values that do not fit a receive are moved by RDMA READ instead.
+ *
+ * Consumed buffers are reposted in chains of up to RDMA_REPOST_BATCH at
+ * the end of each cq poll. Each srq is armed to raise SRQ_LIMIT_REACHED
+ * when fewer than 1/RDMA_SRQ_LIMIT_DIV of its buffers are posted; the
+ * worker then adds as many buffers again, up to recv_growth times the
+ * configured count, and re-arms it.
+ *
+ * The UD class only feeds the worker's UD qp and is never given to a conn
+ * by size.
+ */
+#define RDMA_RECV_CLASSES 3
+#define RDMA_RECV_SMALL 0
+#define RDMA_RECV_LARGE 1
+#define RDMA_RECV_UD 2
+#define RDMA_CONN_REQ_VERSION 1
+#define RDMA_CONN_REQ_CREDITS 0x01  /* the client keeps to credits */
+#define RDMA_REPOST_BATCH 16
+#define RDMA_SRQ_LIMIT_DIV 4
+
+typedef struct {
+    uint8_t             version;
+    uint8_t             flags;
+    uint8_t             reserved[2];
+    uint32_t            max_msg;    /* network order */
+} rdma_conn_req_t;
+
+typedef struct {
+    int                 size;
+    int                 count;
+    struct ibv_srq      *srq;
+    char                **buf_list;
+    struct ibv_mr       **mr_list;
+    int                 posted;     /* buffers on the srq, updated atomically */
+    int                 credits_out; /* held by clients, updated atomically */
+    int                 max_count;
+    int                 limit_hit;  /* set by the dispatcher, taken by the worker */
+    struct ibv_recv_wr  repost_wr[RDMA_REPOST_BATCH];
+    struct ibv_sge      repost_sge[RDMA_REPOST_BATCH];
+    int                 nrepost;
+    struct ibv_qp       **qp_pool;  /* qps in RESET on this srq, worker only */
+    int                 qp_pool_count;
+} rdma_recv_class_t;
+
+/**
+ * Each worker keeps up to -o rdma_qp_pool qps per receive class created
+ * ahead of time, so a connect only has to move one to INIT and accept.
+ * Taking the pool below its size schedules a refill on the worker's base,
+ * RDMA_QP_POOL_BATCH qps per turn of the loop so connects keep flowing.
+ *
+ * The time from the dispatcher seeing a connect request to the worker's
+ * accept is kept in a log-linear histogram: four buckets per power of two
+ * microseconds, the first four exact.
+ */
+#define RDMA_QP_POOL_BATCH 4
+#define RDMA_CONNECT_HIST_BUCKETS 96
+
 /**
  * Stats stored per-thread.
  */
@@ -252,6 +319,40 @@ struct thread_stats {
     uint64_t          conn_yields; /* # of yields for connections (-R option)*/
     uint64_t          auth_cmds;
     uint64_t          auth_errors;
+    uint64_t          rdma_pool_hits;   /* response fragments staged in the send pool */
+    uint64_t          rdma_pool_misses; /* fragments that had to be registered */
+    uint64_t          rdma_reg_calls;   /* memory registrations on the data path */
+    uint64_t          rdma_zero_copy;   /* fragments sent straight from item memory */
+    uint64_t          rdma_cmds;        /* commands executed on RDMA conns */
+    uint64_t          rdma_cqes;        /* completions polled */
+    uint64_t          rdma_sends;       /* responses posted */
+    uint64_t          rdma_inline_sends; /* responses copied into the wqe */
+    uint64_t          rdma_read_chunks; /* RDMA READs posted for values */
+    uint64_t          rdma_send_chains; /* responses posted as several work requests */
+    uint64_t          rdma_send_cqes;   /* responses posted signaled */
+    uint64_t          rdma_cq_wakeups;  /* completion channel events */
+    uint64_t          rdma_cq_spins;    /* empty polls while busy-polling */
+    uint64_t          rdma_cq_rearms;   /* returns from busy-polling to events */
+    uint64_t          rdma_arena_stalls; /* send arena had no chunk for a conn */
+    uint64_t          rdma_arena_chunks; /* filled in when aggregating */
+    uint64_t          rdma_arena_used;
+    uint64_t          rdma_recv_buffers[RDMA_RECV_CLASSES]; /* filled in when aggregating */
+    uint64_t          rdma_recv_posted[RDMA_RECV_CLASSES];
+    uint64_t          rdma_srq_limit_events; /* a srq ran below its limit */
+    uint64_t          rdma_srq_grown;   /* receive buffers added since start */
+    uint64_t          rdma_srq_capped;  /* limit events with no room to grow */
+    uint64_t          rdma_srq_empty;   /* receives that left their srq empty */
+    uint64_t          rdma_ud_recvs;    /* datagrams received */
+    uint64_t          rdma_ud_sends;    /* datagrams posted */
+    uint64_t          rdma_ud_drops;    /* datagrams or replies given up */
+    uint64_t          rdma_credit_updates; /* messages carrying only credits */
+    uint64_t          rdma_credit_short; /* grants cut short by the srq */
+    uint64_t          rdma_credit_overruns; /* receives beyond the client's credits */
+    uint64_t          rdma_counter_creates; /* counters given a slot */
+    uint64_t          rdma_counter_full;    /* no free slot near the key's hash */
+    uint64_t          rdma_qp_pool_hits; /* connects served from the qp pool */
+    uint64_t          rdma_qp_pool_misses; /* connects that created their qp */
+    uint64_t          rdma_connect_hist[RDMA_CONNECT_HIST_BUCKETS]; /* usec to accept */
     struct slab_stats slab_stats[MAX_NUMBER_OF_SLAB_CLASSES];
 };
 
@@ -291,6 +392,18 @@ struct stats {
     uint64_t      lru_crawler_starts; /* Number of item crawlers kicked off */
     bool          lru_crawler_running; /* crawl in progress */
     uint64_t      lru_maintainer_juggles; /* number of LRU bg pokes */
+    uint64_t      rdma_arena_reg_usec; /* time spent registering arena MRs */
+    uint64_t      rdma_conns_reused;   /* conns taken from a worker's pool */
+    uint64_t      rdma_conns_shed;     /* closed to move load off a worker */
+    uint64_t      rdma_ud_clients;     /* SIDR requests answered */
+    uint64_t      rdma_qp_error_events; /* async events, by class */
+    uint64_t      rdma_cq_error_events;
+    uint64_t      rdma_srq_error_events;
+    uint64_t      rdma_port_events;
+    uint64_t      rdma_device_fatal_events;
+    uint64_t      rdma_other_events;
+    uint64_t      rdma_error_completions; /* work completions with a bad status */
+    uint64_t      rdma_ud_qp_resets;
 };
 
 #define MAX_VERBOSITY_LEVEL 2
@@ -356,6 +469,8 @@ extern struct settings settings;
 #define ITEM_FETCHED 8
 /* Appended on fetch, removed on LRU shuffling */
 #define ITEM_ACTIVE 16
+/* Value lives in the RDMA counter table (-o rdma_counters) */
+#define ITEM_COUNTER 32
 
 /**
  * Structure for storing items within memcached.
@@ -402,6 +517,171 @@ typedef struct {
 } crawler;
 
 struct hashtable_s;
+
+/**
+ * Every device in use gets its own contiguous group of workers, pinned to
+ * the device's NUMA node when it is known. Conns are placed on a worker
+ * of the device they arrived on.
+ */
+#define RDMA_MAX_DEVICES 32
+
+typedef struct {
+    struct ibv_context  *verbs;
+    int                 numa_node;      /* -1 if unknown */
+    int                 first_thread;
+    int                 nthreads;
+    int                 last_thread;    /* round robin within the group */
+    int                 imbalance_secs; /* how long one worker has been hot */
+    struct event        async_event;    /* device events, on the dispatcher */
+    int                 max_inline;     /* what its qps accept, probed at startup */
+} rdma_device_t;
+
+/**
+ * Pre-registered send buffers. Each worker owns one pool per protection
+ * domain; a class is a single registered slab carved into equal chunks.
+ */
+#define RDMA_SEND_POOL_CLASSES 6
+#define RDMA_SEND_POOL_MIN_CHUNK 1024   /* class i holds chunks of 1k << 2i */
+#define RDMA_SEND_POOL_MAX_SIZE (1024 * 1024 * 1024) /* bytes per class */
+
+typedef struct rdma_sbuf_s {
+    struct rdma_sbuf_s  *next;
+    char                *buf;
+    uint32_t            lkey;
+    int                 clsid;
+} rdma_sbuf_t;
+
+typedef struct {
+    size_t              chunk_size;
+    int                 nchunks;
+    char                *base;
+    struct ibv_mr       *mr;
+    rdma_sbuf_t         *chunks;
+    rdma_sbuf_t         *free_list;
+} rdma_send_class_t;
+
+typedef struct {
+    pthread_mutex_t     lock;   /* only its worker takes it, uncontended */
+    rdma_send_class_t   classes[RDMA_SEND_POOL_CLASSES];
+} rdma_send_pool_t;
+
+/**
+ * Reply lines and small values are staged in a send arena shared by all
+ * conns of a worker instead of a registered buffer per conn. A conn appends
+ * to the chunk it holds, takes another when it is full (at most
+ * RDMA_ARENA_CONN_CHUNKS at a time) and gives them back when the send that
+ * used them last completes, or all of them when it goes idle.
+ */
+#define RDMA_ARENA_CHUNK 2048
+#define RDMA_ARENA_MAX_SIZE (1024 * 1024 * 1024) /* bytes per worker */
+#define RDMA_ARENA_CONN_CHUNKS 4
+
+typedef struct {
+    pthread_mutex_t     lock;   /* its worker, and stats readers for nfree */
+    char                *base;
+    struct ibv_mr       *mr;
+    rdma_sbuf_t         *chunks;
+    rdma_sbuf_t         *free_list;
+    int                 nchunks;
+    int                 nfree;
+} rdma_send_arena_t;
+
+/**
+ * Several commands may arrive in one receive. Receives that complete while
+ * the previous one is still being parsed, or while the conn waits for its
+ * sends to complete, are parked on the conn (up to RDMA_PENDING_RECV of them) and taken
+ * in order. Responses are gathered into one post while commands remain, up
+ * to half of the send sge list and while the conn may take another arena
+ * chunk for the next reply.
+ */
+#define RDMA_MAX_SEND_SGE 16
+#define RDMA_PENDING_RECV 32    /* also the largest credit window */
+
+/**
+ * A response with more fragments than one work request takes goes out as
+ * a chain of them, posted with one doorbell: SENDs, or RDMA WRITEs to
+ * consecutive offsets of the client's buffer ending in the one WRITE with
+ * immediate data. A chained SEND reply keeps its "END\r\n" so the client
+ * can tell the last message. Connected qps hold RDMA_SEND_WR requests; a
+ * response takes at most half of them.
+ */
+#define RDMA_SEND_WR 512
+#define RDMA_SEND_MAX_SGE (RDMA_SEND_WR / 2 * RDMA_MAX_SEND_SGE)
+
+/**
+ * Values that come by RDMA READ are read in RDMA_READ_CHUNK pieces with up
+ * to RDMA_READ_DEPTH of them in flight, bounded by the initiator depth the
+ * conn was accepted with.
+ */
+#define RDMA_READ_CHUNK (64 * 1024)
+#define RDMA_READ_DEPTH 4
+
+/**
+ * Responses are posted unsignaled except every signal_interval-th one and
+ * those that hold buffers which must come back soon. A send queue
+ * completes in order, so one completion releases everything posted up to
+ * its sequence number; each posted response records what it holds.
+ */
+#define RDMA_SEND_WINDOW 64
+
+typedef struct {
+    uint32_t            seq;
+    int                 nsbuf;      /* leading entries of the conn lists */
+    int                 nachunk;
+    int                 nwmr;
+    int                 nitems;
+    int                 nsuffix;
+    int                 nwr;        /* work requests of a connected qp it took */
+    int                 ndgram;     /* UD datagrams the response went out as */
+    struct rdma_ud_ah_s *ud_ah;     /* UD destination, one reference */
+    item                *item;
+    char                *write_and_free;
+} rdma_send_rec_t;
+
+/**
+ * Unreliable datagram mode (-o rdma_ud_count). A worker with UD clients
+ * owns one UD qp that all of them share, created on the first client. A
+ * client learns the qp through a SIDR exchange on the RDMA_PS_UDP port,
+ * then sends datagrams framed like the UDP protocol: request id, sequence
+ * number, datagram count and a reserved field, 16 bits each in network
+ * order. A request must fit one datagram. A reply goes out in as many as
+ * it needs, up to half the send ring; a client that misses one retries
+ * the request under the same id.
+ *
+ * Address handles are cached per worker by source qp, lid and gid and
+ * counted: the cache, every received datagram waiting to be parsed and
+ * every reply in flight hold a reference.
+ */
+#define RDMA_UD_GRH 40              /* written by the hca ahead of each datagram */
+#define RDMA_UD_MAX_MSG 4096        /* largest datagram, capped by the path mtu */
+#define RDMA_UD_SEND_WR 1024        /* datagrams in flight per worker */
+#define RDMA_UD_POST_BATCH 32       /* datagrams chained per post */
+#define RDMA_UD_AH_CACHE 1024
+
+typedef struct rdma_ud_ah_s {
+    struct ibv_ah       *ah;
+    int                 refs;
+} rdma_ud_ah_t;
+
+typedef struct {
+    rdma_ud_ah_t        *ah;
+    uint32_t            qpn;
+    uint16_t            lid;
+    union ibv_gid       gid;        /* zero when the datagram had no grh */
+} rdma_ud_peer_t;
+
+typedef struct {
+    struct ibv_qp       *qp;
+    struct conn         *conn;      /* every datagram runs through this one */
+    uint8_t             port_num;
+    int                 payload;    /* reply bytes per datagram */
+    char                *hdrs;      /* one frame header per send slot */
+    struct ibv_mr       *hdr_mr;
+    uint32_t            next_hdr;
+    int                 inflight;   /* datagrams posted and not reclaimed */
+    rdma_ud_peer_t      peers[RDMA_UD_AH_CACHE];
+} rdma_ud_t;
+
 typedef struct {
     pthread_t thread_id;        /* unique ID of this thread */
     struct event_base *base;    /* libevent handle this thread uses */
@@ -413,21 +693,46 @@ typedef struct {
     cache_t *suffix_cache;      /* suffix cache */
 
     /* RDMA PART */
+    rdma_device_t               *device;
+    pthread_mutex_t             conn_pool_lock;
+    struct conn                 *conn_pool; /* closed conns to recycle */
+    int                         conn_pool_count;
     size_t                      ack_events;
     struct ibv_comp_channel     *comp_channel;
     struct ibv_pd               *pd;
     struct ibv_cq               *cq;
-    struct ibv_srq              *srq;
     struct event                poll_event;
+    struct rdma_event_channel   *cm_channel; /* the ids of its conns */
+    struct event                cm_event;
 
-    size_t                      rsize;
-    char                        **rbuf_list;
-    struct ibv_mr               **rmr_list;
-    struct ibv_sge              *rsglist;
-    struct ibv_recv_wr          *rwr_list;
+    rdma_recv_class_t           recv_classes[RDMA_RECV_CLASSES];
     struct ibv_wc               *poll_wc;
+    struct ibv_send_wr          *send_chain; /* scratch for chained responses */
 
     struct hashtable_s          *qp_hash;
+
+    bool                        cq_polling; /* busy-polling, cq not armed */
+    uint64_t                    cq_last_usec; /* last time completions were found */
+    uint64_t                    cq_gap_usec;  /* moving average gap between them */
+    uint64_t                    cq_spins;     /* not yet added to stats */
+
+    /* load seen by conn placement on the dispatcher */
+    int                         load_conns;   /* counted on dispatch, updated atomically */
+    int                         load_wrs;     /* posted and not completed, atomic */
+    uint32_t                    load_cqe_rate; /* completions per second, smoothed */
+    uint32_t                    load_window_cqes;
+    uint64_t                    load_window_usec; /* start of the current sample */
+
+    rdma_send_pool_t            send_pool;
+    rdma_send_arena_t           send_arena;
+    struct ibv_mr               *arena_mr;  /* covers all item memory, or NULL */
+    bool                        arena_reads; /* arena_mr can take RDMA READs */
+    struct ibv_mr               *rindex_mr; /* remote index and its copies, readable by clients */
+    struct ibv_mr               *counters_mr; /* counter table, for remote atomics */
+    rdma_ud_t                   *ud;        /* after the first UD client */
+    bool                        cq_failed;  /* overrun, no new conns placed here */
+    struct event                qp_pool_event;
+    bool                        qp_pool_pending; /* a refill is scheduled */
 } LIBEVENT_THREAD;
 
 typedef struct {
@@ -441,7 +746,11 @@ typedef struct {
 typedef struct conn conn;
 struct conn {
     /* RDMA PART */
-    struct rdma_cm_id           *id;
+    struct rdma_cm_id           *id;        /* NULL for the UD conn */
+    struct ibv_qp               *qp;
+    rdma_ud_t                   *ud;        /* only on the worker's UD conn */
+    rdma_ud_ah_t                *ud_ah;     /* where the reply being built goes */
+    uint32_t                    ud_qpn;
 
     /* shared */
     struct ibv_comp_channel     *comp_channel;
@@ -449,32 +758,71 @@ struct conn {
     struct ibv_pd               *pd;
     struct ibv_cq               *cq;
     struct ibv_srq              *srq;
+    rdma_recv_class_t           *rclass;    /* buffers the srq hands out */
 
     /* unique */
-    struct ibv_mr               *wmr;
-    int                         wused; 
+    rdma_sbuf_t                 *achunks[RDMA_ARENA_CONN_CHUNKS]; /* send arena, last one filling */
+    int                         achunk_used;
+    int                         aused;      /* bytes filled in the last chunk */
 
     struct ibv_sge              *sge;
     int                         sge_size;
     int                         sge_used;
 
     struct ibv_mr               **wmr_list;
+    int                         wmr_size;
     int                         wmr_used;
 
+    rdma_sbuf_t                 **sbuf_list; /* pool chunks held until send completes */
+    int                         sbuf_size;
+    int                         sbuf_used;
+
     enum conn_states            write_state;
 
+    rdma_send_rec_t             send_recs[RDMA_SEND_WINDOW];
+    uint32_t                    send_seq;   /* last response posted */
+    uint32_t                    send_acked; /* last response reclaimed */
+    int                         unsignaled;
+    int                         send_wrs;   /* work requests posted, not yet reclaimed */
+    bool                        credit_flow; /* the client keeps to credits */
+    bool                        credit_update; /* the post carries only credits */
+    int                         credits_held; /* sends the client may still make */
+    bool                        end_dropped; /* the reply's "END\r\n" was left out */
+    int                         max_inline; /* replies up to this are sent inline */
+    int                         sent_sbufs; /* list entries owned by send_recs */
+    int                         sent_achunks;
+    int                         sent_wmrs;
+    int                         sent_items;
+    int                         sent_suffixes;
+    bool                        send_parked; /* waiting for every send to complete */
+    enum conn_states            resume_state;
+
     int                         continue_nread;
 
-    struct ibv_mr               *read_mr;
+    struct ibv_mr               *rmr;       /* receive being parsed */
+    uint32_t                    rmr_len;
+    struct ibv_mr               *pending_mr[RDMA_PENDING_RECV];
+    uint32_t                    pending_len[RDMA_PENDING_RECV];
+    int                         pending_head;
+    int                         pending_count;
+    int                         recv_cmds;  /* commands run from the receive so far */
+    char                        *rcont;     /* where the command being run ends */
+
+    struct ibv_mr               *read_mr;   /* only when the item is not in arena_mr */
     uint32_t                    read_size;
+    uint32_t                    read_total; /* value bytes to read, 0 when idle */
+    uint32_t                    read_posted;
+    int                         read_inflight;
+    int                         read_depth; /* reads the qp may have outstanding */
 
     uint64_t                    remote_addr;
     uint32_t                    remote_rkey;
 
-    struct ibv_mr               *write_ack_mr;
-
     /* statistics */
     int                         total_cqe;
+    int                         cqe_mark;   /* total_cqe at the last rebalance */
+    bool                        shed;       /* close at the next command boundary */
+    bool                        failed;     /* qp in error, disconnect already asked */
     int                         total_recv_msg;
     int                         total_post_recv;
 
@@ -597,6 +945,8 @@ enum delta_result_type do_add_delta(conn *c, const char *key,
                                     const int64_t delta, char *buf,
                                     uint64_t *cas, const uint32_t hv);
 enum store_item_type do_store_item(item *item, int comm, conn* c, const uint32_t hv);
+enum store_item_type do_counter_store(item *it, conn *c, const uint64_t initial,
+                                      uint32_t *slot, const uint32_t hv);
 conn *conn_new(const int sfd, const enum conn_states init_state, const int event_flags, const int read_buffer_size, enum network_transport transport, struct event_base *base);
 extern int daemonize(int nochdir, int noclose);
 
@@ -627,6 +977,8 @@ enum delta_result_type add_delta(conn *c, const char *key,
                                  const size_t nkey, const int incr,
                                  const int64_t delta, char *buf,
                                  uint64_t *cas);
+enum store_item_type counter_store(item *it, conn *c, const uint64_t initial,
+                                   uint32_t *slot);
 void accept_new_conns(const bool do_accept);
 conn *conn_from_freelist(void);
 bool  conn_add_to_freelist(conn *c);
@@ -680,16 +1032,217 @@ extern void drop_privileges(void);
 
 #define HEAD_OPERATION '\x88'
 
-void assign_conn_to_thread(conn *c);
-void dispatch_rdma_conn(conn *c);
+/**
+ * Binary control header. A client that wants the server to read its value
+ * or write back the response puts this at the start of the SEND, in front
+ * of an ASCII or binary memcached command. Multi-byte fields are in network
+ * byte order. The legacy text form ("\x88 <addr> <rkey> <size>\n") is
+ * still accepted.
+ */
+#define RDMA_CTRL_MAGIC     0x89
+#define RDMA_CTRL_VERSION   1
+
+enum rdma_ctrl_opcode {
+    RDMA_CTRL_OP_NONE = 0,      /* only carries the remote buffer */
+};
+
+typedef struct {
+    uint8_t             magic;
+    uint8_t             version;
+    uint8_t             opcode;
+    uint8_t             flags;
+    uint32_t            rkey;
+    uint64_t            remote_addr;
+    uint32_t            length;
+    uint32_t            request_id;
+} rdma_ctrl_hdr_t;
+
+/**
+ * Responses to clients that advertise a remote buffer are delivered as a
+ * single RDMA WRITE with immediate data. The immediate (network order)
+ * carries a status in the top 8 bits and the number of bytes written in
+ * the low 24; RDMA_IMM_STATUS_LONG means the response was larger than the
+ * length field and the client has to parse the buffer for the terminator.
+ * As before, the trailing "END\r\n" of a GET is not written when the
+ * receive held a single command; the completion itself marks the end of
+ * the response. Pipelined receives get regular text protocol framing.
+ */
+#define RDMA_IMM_STATUS_OK      0
+#define RDMA_IMM_STATUS_LONG    1
+#define RDMA_IMM_LEN_MASK       0xffffff
+#define RDMA_IMM(status, len)   htonl(((uint32_t)(status) << 24) | ((len) & RDMA_IMM_LEN_MASK))
+
+/**
+ * Credit flow control (-o rdma_credits). A client that sets
+ * RDMA_CONN_REQ_CREDITS is granted credits in rdma_conn_rep_t and keeps
+ * no more SENDs in flight than it holds; each costs one. Every response
+ * then carries an immediate (SENDs become SENDs with immediate) of
+ * status:4 credits:8 length:20, the credits handed back with it. A client
+ * left with none and no reply due gets an empty RDMA_IMM_STATUS_CREDIT
+ * message. A worker grants no more credits per receive class than the
+ * class has buffers posted, so a client within its credits does not meet
+ * an empty srq and RNR retries; every conn keeps at least one.
+ */
+#define RDMA_IMM_STATUS_CREDIT      2
+#define RDMA_IMM_CREDIT_MAX         255
+#define RDMA_IMM_CREDIT_LEN_MASK    0xfffff
+#define RDMA_IMM_CREDIT(status, credits, len) htonl(((uint32_t)(status) << 28) \
+        | ((uint32_t)(credits) << 20) | ((len) & RDMA_IMM_CREDIT_LEN_MASK))
+
+/**
+ * Remotely readable index (-o rdma_remote_index=<power>).
+ *
+ * One 64-byte slot per (hv & mask), published by the server whenever an
+ * item is stored or changed and cleared on delete. Each slot owns
+ * RDMA_RINDEX_DATA bytes after the slots, where the server copies the
+ * item's key, suffix and data; larger items are not published. Clients
+ * can only read this region, never item memory. A client serves a GET
+ * with two RDMA READs and no server CPU:
+ *
+ *   1. read the slot at index_addr + (hv & mask) * 64 with index_rkey;
+ *      retry while seq is odd (the server is rewriting it)
+ *   2. read len bytes at addr with the same rkey: the key, '\0', the
+ *      " <flags> <bytes>\r\n" suffix and the data
+ *   3. accept the value only if slot.hv equals the key's hash, the key
+ *      matches and the checksum of the data equals slot.csum (computed
+ *      with the server's hash_algorithm); otherwise fall back to a
+ *      two-sided GET. slot.cas is the item's CAS.
+ *
+ * Evicted items are not retracted, step 3 is what detects stale slots and
+ * torn reads. The rkey is handed out as rdma_accept() private data.
+ */
+#define RDMA_RINDEX_VERSION 2
+#define RDMA_RINDEX_DATA 512
+
+typedef struct {
+    volatile uint64_t   seq;    /* odd while being updated */
+    uint32_t            hv;
+    uint32_t            len;    /* bytes copied at addr, 0 if retracted */
+    uint64_t            addr;
+    uint64_t            cas;
+    uint32_t            csum;
+    uint32_t            pad[7];
+} rdma_rindex_slot_t;
+
+typedef struct {
+    uint32_t            version;
+    uint32_t            power;
+    uint64_t            index_addr;
+    uint32_t            index_rkey;
+    uint32_t            data_size;  /* RDMA_RINDEX_DATA */
+} rdma_rindex_info_t;
+
+/*
+ * Remote-atomic counters (-o rdma_counters=<power>).
+ *
+ * A counter is an item whose value is not kept in the item but in one
+ * 8-byte aligned slot of a table registered for remote atomics, so a
+ * client can incr/decr it with RDMA FETCH_AND_ADD or CMP_AND_SWP and no
+ * server CPU. It is created with
+ *
+ *   counter <key> <flags> <exptime> <initial> [noreply]
+ *
+ * which answers "COUNTER <slot>", and "counter <key>" looks up the slot
+ * of an existing one. The slot's address is counters_addr + slot * 8,
+ * with counters_rkey from the rdma_accept() private data. get renders the
+ * value as 20 space-padded digits, incr/decr on the server update it in
+ * place, append and prepend are refused.
+ *
+ * Slots are picked near the key's hash within its item lock and stay
+ * with the item until it is deleted, replaced, expired or evicted; a
+ * later counter may then reuse the slot, so a client must stop using a
+ * slot once the key may be gone. Remote FETCH_AND_ADD wraps below zero
+ * where decr stops at 0. When the device's atomics are not coherent with
+ * the CPU's (atomic_cap below IBV_ATOMIC_GLOB), incr/decr on the server
+ * would race them and are refused.
+ */
+#define RDMA_COUNTER_PROBES 4
+#define RDMA_COUNTER_NBYTES 22      /* 20 digits and "\r\n" */
+
+typedef struct {
+    uint64_t            counters_addr;
+    uint32_t            counters_rkey;
+    uint32_t            counters_power;     /* 0 without counters */
+} rdma_counter_info_t;
+
+/* rdma_accept() private data; rindex.version is 0 without a remote index */
+typedef struct {
+    rdma_rindex_info_t  rindex;
+    uint32_t            credits;    /* network order, 0 without credits */
+    rdma_counter_info_t counters;
+} rdma_conn_rep_t;
+
+LIBEVENT_THREAD *select_rdma_thread(struct rdma_cm_id *id);
+void rdma_thread_stats(ADD_STAT add_stats, conn *c);
+uint64_t rdma_now_usec(void);
+void rdma_rebalance_tick(void);
+void rdma_shed_busiest_conn(LIBEVENT_THREAD *me);
+void rdma_ud_recover(LIBEVENT_THREAD *me);
+void rdma_ud_forget_peers(LIBEVENT_THREAD *me);
+void rdma_fail_worker(LIBEVENT_THREAD *me);
+void rdma_notify_device_workers(rdma_device_t *dev, char cmd);
+void dispatch_rdma_conn(LIBEVENT_THREAD *thread, struct rdma_cm_event *cm_event);
+struct ibv_qp *rdma_qp_pool_get(LIBEVENT_THREAD *me, rdma_recv_class_t *cls);
+struct ibv_qp *rdma_create_rc_qp(LIBEVENT_THREAD *me, rdma_recv_class_t *cls);
+uint64_t rdma_connect_percentile(struct thread_stats *stats, double q);
+int rdma_ud_accept(LIBEVENT_THREAD *thread, struct rdma_cm_id *id);
+int rdma_accept_conn(LIBEVENT_THREAD *thread, struct rdma_cm_id *id,
+                     struct rdma_conn_param *req_param);
+void rdma_worker_cm_handler(int fd, short libevent_event, void *arg);
 int rdma_conn_init(conn *c, enum conn_states init_state,
                    const int read_buffer_size, struct event_base *base);
 void cc_poll_event_handler(int fd, short libevent_event, void *arg);
+bool rdma_spin_cq(LIBEVENT_THREAD *me);
+rdma_sbuf_t *rdma_send_pool_get(LIBEVENT_THREAD *me, size_t len);
+void rdma_send_pool_put(LIBEVENT_THREAD *me, rdma_sbuf_t *sbuf);
+rdma_sbuf_t *rdma_send_arena_get(LIBEVENT_THREAD *me);
+void rdma_send_arena_put(LIBEVENT_THREAD *me, rdma_sbuf_t *chunk);
+void rdma_srq_limit_reached(LIBEVENT_THREAD *me, struct ibv_srq *srq);
+int rdma_flush_reposts(LIBEVENT_THREAD *me);
+
+/**
+ * How workers learn about completions. In event mode every completion
+ * comes in through the comp_channel fd. In busy mode a worker that was
+ * woken keeps polling its cq until it has been idle for spin_usec and
+ * only then re-arms notification. Adaptive mode spins for about twice
+ * the recent gap between completions, and not at all when traffic is
+ * sparser than spin_usec.
+ */
+enum rdma_poll_mode {
+    RDMA_POLL_EVENT,
+    RDMA_POLL_BUSY,
+    RDMA_POLL_ADAPTIVE
+};
+
+/**
+ * How a new conn picks a worker within its device group. Load placement
+ * takes the worker with the lowest score of conns, posted work requests
+ * and recent completion rate; host placement sends every conn from one
+ * client address to the same worker.
+ */
+enum rdma_placement {
+    RDMA_PLACE_LOAD,
+    RDMA_PLACE_RR,
+    RDMA_PLACE_HOST
+};
+
+#define RDMA_LOAD_WINDOW_USEC 100000    /* completion rate sample period */
+#define RDMA_LOAD_CONN_WEIGHT 8         /* a conn counts as this many WRs */
+
+/**
+ * A qp's cq and srq are fixed when it is created, so a conn cannot be
+ * handed to another worker. The rebalancer instead asks a worker that
+ * has stayed well above the quietest one in its group to close its
+ * busiest conn at a command boundary; the client reconnects and load
+ * placement puts it elsewhere.
+ */
+#define RDMA_REBALANCE_RATIO 2
 
 struct rdma_context {
     struct ibv_context          **device_ctx_list;
-    struct ibv_context          *device_ctx_used;
-    int                         device_index;
+    uint32_t                    device_mask;    /* indexes to use, -x */
+    rdma_device_t               devices[RDMA_MAX_DEVICES];
+    int                         ndevices;
     struct rdma_event_channel   *cm_channel;
     struct event                listen_event; 
 
@@ -697,27 +1250,53 @@ struct rdma_context {
     int                         srq_size;
     int                         buff_per_thread;
     int                         buff_size;
+    int                         recv_small_count; /* small receive buffers per worker */
+    int                         recv_small_size;
+    int                         recv_growth;    /* classes grow up to this many times */
+    int                         inline_size;    /* largest reply to send inline */
     int                         poll_wc_size;
     int                         ack_events;
+    size_t                      send_pool_size; /* bytes per send pool class */
+    size_t                      send_arena_size; /* bytes of send arena per worker */
+    bool                        arena_mr;       /* register item memory per pd */
+    int                         zero_copy_min;  /* smallest item value sent in place */
+    rdma_rindex_slot_t          *rindex;        /* remote index, or NULL */
+    char                        *rindex_data;   /* copies of published items, after it */
+    int                         rindex_power;
+    volatile uint64_t           *counters;      /* counter table, or NULL */
+    item                        **counter_owners; /* item holding each slot */
+    int                         counters_power;
+    bool                        counters_local; /* CPU atomics are coherent with the devices' */
+    int                         signal_interval; /* sends per signaled send */
+    int                         conn_pool_max;  /* recycled conns kept per worker */
+    enum rdma_poll_mode         poll_mode;
+    int                         spin_usec;      /* busy-poll budget after activity */
+    enum rdma_placement         placement;
+    int                         rebalance_secs; /* imbalance to tolerate, 0 is off */
+    int                         ud_count;       /* UD receive buffers per worker, 0 is off */
+    int                         credits;        /* credit window per conn, 0 is off */
+    int                         qp_pool;        /* qps kept per worker and class */
 };
 extern struct rdma_context rdma_context;
 
-/* hash table */
+/* qp_num to conn table */
 typedef struct hash_item_s {
-    struct hash_item_s *next;
-    int32_t key;
+    uint32_t key;
     void *p;
 } hash_item_t;
 
 typedef struct hashtable_s {
-    size_t size;
+    unsigned int power;
+    size_t mask;
+    size_t count;
+    size_t tombstones;
     hash_item_t *T;
+    pthread_mutex_t lock;
 } hashtable_t;
 
 hashtable_t* hashtable_create(size_t size);
-size_t calc_hash(hashtable_t *h, int32_t key);
 void hashtable_free(hashtable_t *h);
-int hashtable_insert(hashtable_t *h, int32_t key, void *p);
-void *hashtable_search(hashtable_t *h, int32_t key);
-void hashtable_delete(hashtable_t *h, int32_t key);
+int hashtable_insert(hashtable_t *h, uint32_t key, void *p);
+void *hashtable_search(hashtable_t *h, uint32_t key);
+void hashtable_delete(hashtable_t *h, uint32_t key);
 
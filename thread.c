@@ -10,6 +10,7 @@
 #include <errno.h>
 #include <string.h>
 #include <pthread.h>
+#include <fcntl.h>
 
 #ifdef __sun
 #include <atomic.h>
@@ -17,6 +18,9 @@
 
 #define ITEMS_PER_ALLOC 64
 
+/* connect private data is at most 56 bytes on IB, 196 on iWARP */
+#define RDMA_CM_PRIVATE_MAX 196
+
 
 /***************************************************************************//**
  * RDMA Part
@@ -24,11 +28,25 @@
 struct conn;
 
 static int init_rdma_thread_resources(LIBEVENT_THREAD *me);
+static void init_rdma_device_groups(int nthreads);
+static void rdma_bind_thread_node(LIBEVENT_THREAD *me);
+static int init_rdma_send_pool(LIBEVENT_THREAD *me);
+static int init_rdma_send_arena(LIBEVENT_THREAD *me);
+static int init_rdma_recv_class(LIBEVENT_THREAD *me, int clsid, int size, int count);
+static int rdma_recv_class_grow(LIBEVENT_THREAD *me, rdma_recv_class_t *cls, int n);
+static void rdma_recv_replenish(LIBEVENT_THREAD *me);
+static int init_rdma_arena_mr(LIBEVENT_THREAD *me);
+static bool rdma_qp_pool_fill(LIBEVENT_THREAD *me);
+static void rdma_qp_pool_refill(int fd, short which, void *arg);
+static void rdma_connect_sample(LIBEVENT_THREAD *me, uint64_t usec);
 
 /* An item in the connection queue. */
 typedef struct conn_queue_item CQ_ITEM;
 struct conn_queue_item {
-    conn *cm_ctx;
+    struct rdma_cm_id       *cm_id;
+    struct rdma_conn_param  cm_param;   /* private data points at cm_private */
+    uint8_t                 cm_private[RDMA_CM_PRIVATE_MAX];
+    uint64_t                cm_usec;    /* when the dispatcher saw the request */
     int               sfd;
     enum conn_states  init_state;
     int               event_flags;
@@ -371,11 +389,6 @@ static void setup_thread(LIBEVENT_THREAD *me) {
         fprintf(stderr, "Failed to create suffix cache\n");
         exit(EXIT_FAILURE);
     }
-
-    if (0 != init_rdma_thread_resources(me)) {
-        fprintf(stderr, "Can't init rdma resources in thread\n");
-        exit(EXIT_FAILURE);
-    }
 }
 
 /*
@@ -388,9 +401,33 @@ static void *worker_libevent(void *arg) {
      * all threads have finished initializing.
      */
 
+    /* verbs resources are set up here, after pinning, so their memory is
+     * first touched on the device's node */
+    rdma_bind_thread_node(me);
+    if (0 != init_rdma_thread_resources(me)) {
+        fprintf(stderr, "Can't init rdma resources in thread\n");
+        exit(EXIT_FAILURE);
+    }
+
     register_thread_initialized();
 
-    event_base_loop(me->base, 0);
+    if (RDMA_POLL_EVENT == rdma_context.poll_mode) {
+        event_base_loop(me->base, 0);
+        return NULL;
+    }
+
+    /* while the cq is busy-polled, other events are only checked now and then */
+    int rounds = 0;
+    for (;;) {
+        if (!me->cq_polling) {
+            event_base_loop(me->base, EVLOOP_ONCE);
+            continue;
+        }
+        if (!rdma_spin_cq(me) || ++rounds == 64) {
+            event_base_loop(me->base, EVLOOP_NONBLOCK);
+            rounds = 0;
+        }
+    }
     return NULL;
 }
 
@@ -411,19 +448,44 @@ static void thread_libevent_process(int fd, short which, void *arg) {
     switch (buf[0]) {
     case 'c':
         item = cq_pop(me->new_conn_queue);
-        if (NULL != item) {
-            if (0 != rdma_conn_init(item->cm_ctx, item->init_state,
-                    item->read_buffer_size, me->base)) {
-                perror("rdma_conn_init()");
-                rdma_disconnect(item->cm_ctx->id);
-
+        if (NULL != item && IS_UDP(item->transport)) {
+            if (0 != rdma_ud_accept(me, item->cm_id)) {
+                rdma_reject(item->cm_id, NULL, 0);
+            }
+            rdma_destroy_id(item->cm_id);
+            cqi_free(item);
+        } else if (NULL != item) {
+            if (0 != rdma_accept_conn(me, item->cm_id, &item->cm_param)) {
+                rdma_reject(item->cm_id, NULL, 0);
+                rdma_destroy_id(item->cm_id);
             } else {
-                item->cm_ctx->thread = me;
+                rdma_connect_sample(me, rdma_now_usec() - item->cm_usec);
             }
             cqi_free(item);
         }
         break;
 
+    /* an srq ran low */
+    case 'r':
+        rdma_recv_replenish(me);
+        break;
+
+    /* the rebalancer wants load moved off this worker */
+    case 'm':
+        rdma_shed_busiest_conn(me);
+        break;
+
+    /* async events the dispatcher saw on this worker's qps or cq */
+    case 'u':
+        rdma_ud_recover(me);
+        break;
+    case 'a':
+        rdma_ud_forget_peers(me);
+        break;
+    case 'x':
+        rdma_fail_worker(me);
+        break;
+
     /*
     item = cq_pop(me->new_conn_queue);
 
@@ -628,6 +690,21 @@ enum store_item_type store_item(item *item, int comm, conn* c) {
     return ret;
 }
 
+/*
+ * Stores a new RDMA counter, see do_counter_store().
+ */
+enum store_item_type counter_store(item *it, conn *c, const uint64_t initial,
+                                   uint32_t *slot) {
+    enum store_item_type ret;
+    uint32_t hv;
+
+    hv = hash(ITEM_key(it), it->nkey);
+    item_lock(hv);
+    ret = do_counter_store(it, c, initial, slot, hv);
+    item_unlock(hv);
+    return ret;
+}
+
 /******************************* GLOBAL STATS ******************************/
 
 void STATS_LOCK() {
@@ -657,6 +734,36 @@ void threadlocal_stats_reset(void) {
         threads[ii].stats.conn_yields = 0;
         threads[ii].stats.auth_cmds = 0;
         threads[ii].stats.auth_errors = 0;
+        threads[ii].stats.rdma_pool_hits = 0;
+        threads[ii].stats.rdma_pool_misses = 0;
+        threads[ii].stats.rdma_reg_calls = 0;
+        threads[ii].stats.rdma_zero_copy = 0;
+        threads[ii].stats.rdma_cmds = 0;
+        threads[ii].stats.rdma_cqes = 0;
+        threads[ii].stats.rdma_sends = 0;
+        threads[ii].stats.rdma_send_cqes = 0;
+        threads[ii].stats.rdma_inline_sends = 0;
+        threads[ii].stats.rdma_read_chunks = 0;
+        threads[ii].stats.rdma_send_chains = 0;
+        threads[ii].stats.rdma_cq_wakeups = 0;
+        threads[ii].stats.rdma_cq_spins = 0;
+        threads[ii].stats.rdma_cq_rearms = 0;
+        threads[ii].stats.rdma_arena_stalls = 0;
+        threads[ii].stats.rdma_srq_limit_events = 0;
+        threads[ii].stats.rdma_srq_capped = 0;
+        threads[ii].stats.rdma_srq_empty = 0;
+        threads[ii].stats.rdma_ud_recvs = 0;
+        threads[ii].stats.rdma_ud_sends = 0;
+        threads[ii].stats.rdma_ud_drops = 0;
+        threads[ii].stats.rdma_credit_updates = 0;
+        threads[ii].stats.rdma_credit_short = 0;
+        threads[ii].stats.rdma_credit_overruns = 0;
+        threads[ii].stats.rdma_counter_creates = 0;
+        threads[ii].stats.rdma_counter_full = 0;
+        threads[ii].stats.rdma_qp_pool_hits = 0;
+        threads[ii].stats.rdma_qp_pool_misses = 0;
+        memset(threads[ii].stats.rdma_connect_hist, 0,
+               sizeof(threads[ii].stats.rdma_connect_hist));
 
         for(sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
             threads[ii].stats.slab_stats[sid].set_cmds = 0;
@@ -697,6 +804,49 @@ void threadlocal_stats_aggregate(struct thread_stats *stats) {
         stats->conn_yields += threads[ii].stats.conn_yields;
         stats->auth_cmds += threads[ii].stats.auth_cmds;
         stats->auth_errors += threads[ii].stats.auth_errors;
+        stats->rdma_pool_hits += threads[ii].stats.rdma_pool_hits;
+        stats->rdma_pool_misses += threads[ii].stats.rdma_pool_misses;
+        stats->rdma_reg_calls += threads[ii].stats.rdma_reg_calls;
+        stats->rdma_zero_copy += threads[ii].stats.rdma_zero_copy;
+        stats->rdma_cmds += threads[ii].stats.rdma_cmds;
+        stats->rdma_cqes += threads[ii].stats.rdma_cqes;
+        stats->rdma_sends += threads[ii].stats.rdma_sends;
+        stats->rdma_send_cqes += threads[ii].stats.rdma_send_cqes;
+        stats->rdma_inline_sends += threads[ii].stats.rdma_inline_sends;
+        stats->rdma_read_chunks += threads[ii].stats.rdma_read_chunks;
+        stats->rdma_send_chains += threads[ii].stats.rdma_send_chains;
+        stats->rdma_cq_wakeups += threads[ii].stats.rdma_cq_wakeups;
+        stats->rdma_cq_spins += threads[ii].stats.rdma_cq_spins;
+        stats->rdma_cq_rearms += threads[ii].stats.rdma_cq_rearms;
+        stats->rdma_arena_stalls += threads[ii].stats.rdma_arena_stalls;
+        stats->rdma_srq_limit_events += threads[ii].stats.rdma_srq_limit_events;
+        stats->rdma_srq_grown += threads[ii].stats.rdma_srq_grown;
+        stats->rdma_srq_capped += threads[ii].stats.rdma_srq_capped;
+        stats->rdma_srq_empty += threads[ii].stats.rdma_srq_empty;
+        stats->rdma_ud_recvs += threads[ii].stats.rdma_ud_recvs;
+        stats->rdma_ud_sends += threads[ii].stats.rdma_ud_sends;
+        stats->rdma_ud_drops += threads[ii].stats.rdma_ud_drops;
+        stats->rdma_credit_updates += threads[ii].stats.rdma_credit_updates;
+        stats->rdma_credit_short += threads[ii].stats.rdma_credit_short;
+        stats->rdma_credit_overruns += threads[ii].stats.rdma_credit_overruns;
+        stats->rdma_counter_creates += threads[ii].stats.rdma_counter_creates;
+        stats->rdma_counter_full += threads[ii].stats.rdma_counter_full;
+        stats->rdma_qp_pool_hits += threads[ii].stats.rdma_qp_pool_hits;
+        stats->rdma_qp_pool_misses += threads[ii].stats.rdma_qp_pool_misses;
+        for (sid = 0; sid < RDMA_CONNECT_HIST_BUCKETS; sid++) {
+            stats->rdma_connect_hist[sid] += threads[ii].stats.rdma_connect_hist[sid];
+        }
+
+        pthread_mutex_lock(&threads[ii].send_arena.lock);
+        stats->rdma_arena_chunks += threads[ii].send_arena.nchunks;
+        stats->rdma_arena_used += threads[ii].send_arena.nchunks
+            - threads[ii].send_arena.nfree;
+        pthread_mutex_unlock(&threads[ii].send_arena.lock);
+
+        for (sid = 0; sid < RDMA_RECV_CLASSES; sid++) {
+            stats->rdma_recv_buffers[sid] += threads[ii].recv_classes[sid].count;
+            stats->rdma_recv_posted[sid] += threads[ii].recv_classes[sid].posted;
+        }
 
         for (sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
             stats->slab_stats[sid].set_cmds +=
@@ -806,6 +956,8 @@ void memcached_thread_init(int nthreads, struct event_base *main_base) {
     dispatcher_thread.base = main_base;
     dispatcher_thread.thread_id = pthread_self();
 
+    init_rdma_device_groups(nthreads);
+
     for (i = 0; i < nthreads; i++) {
         int fds[2];
         if (pipe(fds)) {
@@ -836,44 +988,247 @@ void memcached_thread_init(int nthreads, struct event_base *main_base) {
  * Dispatch a new rdma connection to another thread.
  *
  ******************************************************************************/
+static int rdma_host_slot(struct rdma_cm_id *id, int nthreads);
+static int rdma_least_loaded(rdma_device_t *dev);
+
+LIBEVENT_THREAD *
+select_rdma_thread(struct rdma_cm_id *id) {
+    rdma_device_t *dev = NULL;
+    int i = 0;
+
+    for (i = 0; i < rdma_context.ndevices; ++i) {
+        if (rdma_context.devices[i].verbs == id->verbs) {
+            dev = &rdma_context.devices[i];
+            break;
+        }
+    }
+    if (!dev) {
+        return NULL;
+    }
+
+    switch (rdma_context.placement) {
+    case RDMA_PLACE_HOST:
+        i = rdma_host_slot(id, dev->nthreads);
+        break;
+    case RDMA_PLACE_LOAD:
+        i = rdma_least_loaded(dev);
+        break;
+    default:
+        /* round robin over the workers of the device the conn arrived on */
+        dev->last_thread = (dev->last_thread + 1) % dev->nthreads;
+        i = dev->last_thread;
+        break;
+    }
+
+    /* a worker whose cq failed takes nothing new */
+    if (i >= 0 && threads[dev->first_thread + i].cq_failed) {
+        i = rdma_least_loaded(dev);
+    }
+    return i < 0 ? NULL : threads + dev->first_thread + i;
+}
+
+/* the same client address always lands on the same worker */
+static int
+rdma_host_slot(struct rdma_cm_id *id, int nthreads) {
+    struct sockaddr *sa = rdma_get_peer_addr(id);
+    uint32_t hv = 0;
+
+    if (sa && AF_INET == sa->sa_family) {
+        struct in_addr *a = &((struct sockaddr_in *)sa)->sin_addr;
+        hv = hash(a, sizeof(*a));
+    } else if (sa && AF_INET6 == sa->sa_family) {
+        struct in6_addr *a = &((struct sockaddr_in6 *)sa)->sin6_addr;
+        hv = hash(a, sizeof(*a));
+    }
+    return hv % nthreads;
+}
+
+/*
+ * A worker's completion rate only moves while it polls, so a sample that
+ * stopped several windows ago belongs to a worker that went quiet.
+ */
+static uint32_t
+rdma_thread_cqe_rate(LIBEVENT_THREAD *t, uint64_t now) {
+    uint64_t start = t->load_window_usec;
+    if (0 == start || now - start > 4 * RDMA_LOAD_WINDOW_USEC) {
+        return 0;
+    }
+    return t->load_cqe_rate;
+}
+
+static uint64_t
+rdma_thread_load(LIBEVENT_THREAD *t, uint64_t now) {
+    int wrs = t->load_wrs;
+    return (uint64_t)t->load_conns * RDMA_LOAD_CONN_WEIGHT
+        + (wrs > 0 ? wrs : 0)
+        + rdma_thread_cqe_rate(t, now) / 1000;
+}
+
+/*
+ * Lowest score wins; ties go round robin so an idle group still spreads.
+ * Returns -1 when every worker of the group has failed.
+ */
+static int
+rdma_least_loaded(rdma_device_t *dev) {
+    uint64_t now = rdma_now_usec();
+    uint64_t best_load = UINT64_MAX;
+    int best = -1, i = 0;
+
+    for (i = 1; i <= dev->nthreads; ++i) {
+        int slot = (dev->last_thread + i) % dev->nthreads;
+        LIBEVENT_THREAD *t = threads + dev->first_thread + slot;
+        if (t->cq_failed) {
+            continue;
+        }
+        uint64_t load = rdma_thread_load(t, now);
+        if (load < best_load) {
+            best_load = load;
+            best = slot;
+        }
+    }
+    if (best >= 0) {
+        dev->last_thread = best;
+    }
+    return best;
+}
+
+/*
+ * Called from the clock handler once a second. A group whose busiest
+ * worker has carried RDMA_REBALANCE_RATIO times the load of its quietest
+ * for rebalance_secs in a row gives up one conn.
+ */
 void
-assign_conn_to_thread(conn *c) {
-    int tid = (last_thread + 1) % settings.num_threads;
-    last_thread = tid;
-    c->thread = threads + tid;
+rdma_rebalance_tick(void) {
+    uint64_t now = rdma_now_usec();
+    int i = 0, t = 0;
+
+    for (i = 0; i < rdma_context.ndevices; ++i) {
+        rdma_device_t *dev = &rdma_context.devices[i];
+        LIBEVENT_THREAD *hot = NULL;
+        uint64_t hot_load = 0, cold_load = UINT64_MAX;
+
+        if (dev->nthreads < 2) {
+            continue;
+        }
+        for (t = dev->first_thread; t < dev->first_thread + dev->nthreads; ++t) {
+            if (threads[t].cq_failed) {
+                continue;
+            }
+            uint64_t load = rdma_thread_load(threads + t, now);
+            if (load > hot_load || !hot) {
+                hot_load = load;
+                hot = threads + t;
+            }
+            if (load < cold_load) {
+                cold_load = load;
+            }
+        }
+
+        /* a lone conn has nowhere better to go */
+        if (!hot || hot->load_conns < 2
+            || hot_load <= RDMA_REBALANCE_RATIO * (cold_load + RDMA_LOAD_CONN_WEIGHT)) {
+            dev->imbalance_secs = 0;
+            continue;
+        }
+        if (++dev->imbalance_secs < rdma_context.rebalance_secs) {
+            continue;
+        }
+        dev->imbalance_secs = 0;
 
-    if (settings.verbose > 1) {
-        fprintf(stderr, "conn %p is assgined to thread %p\n", (void*)c, (void*)c->thread);
+        if (write(hot->notify_send_fd, "m", 1) != 1) {
+            perror("Writing to thread notify pipe");
+        }
     }
+}
 
-    c->comp_channel = c->thread->comp_channel;
-    c->pd = c->thread->pd;
-    c->cq = c->thread->cq;
-    c->srq = c->thread->srq;
+/* hands a pipe command to every worker of a device */
+void
+rdma_notify_device_workers(rdma_device_t *dev, char cmd) {
+    int t = 0;
+
+    for (t = dev->first_thread; t < dev->first_thread + dev->nthreads; ++t) {
+        if (write(threads[t].notify_send_fd, &cmd, 1) != 1) {
+            perror("Writing to thread notify pipe");
+        }
+    }
 }
 
+/* per-worker placement load, for "stats threads" */
 void
-dispatch_rdma_conn(conn *cm_ctx) {
+rdma_thread_stats(ADD_STAT add_stats, conn *c) {
+    char key_str[STAT_KEY_LEN];
+    char val_str[STAT_VAL_LEN];
+    int klen = 0, vlen = 0;
+    uint64_t now = rdma_now_usec();
+    int i = 0, d = 0;
+
+    for (i = 0; i < settings.num_threads; ++i) {
+        LIBEVENT_THREAD *t = threads + i;
+        for (d = 0; d < rdma_context.ndevices; ++d) {
+            if (t->device == &rdma_context.devices[d]) {
+                break;
+            }
+        }
+        APPEND_NUM_STAT(i, "device", "%d", d < rdma_context.ndevices ? d : -1);
+        APPEND_NUM_STAT(i, "conns", "%d", t->load_conns);
+        APPEND_NUM_STAT(i, "outstanding_wrs", "%d", t->load_wrs);
+        APPEND_NUM_STAT(i, "cqe_rate", "%u", rdma_thread_cqe_rate(t, now));
+        APPEND_NUM_STAT(i, "load", "%llu",
+                        (unsigned long long)rdma_thread_load(t, now));
+    }
+}
+
+/*
+ * Hands a connect request to a worker. The event is acked here, with its
+ * private data copied, since an id only migrates to the worker's channel
+ * once none of its events are outstanding.
+ */
+void
+dispatch_rdma_conn(LIBEVENT_THREAD *thread, struct rdma_cm_event *cm_event) {
+    struct rdma_cm_id *id = cm_event->id;
     CQ_ITEM *item = cqi_new();
     char buf[1];
     if (item == NULL) {
-        rdma_disconnect(cm_ctx->id);
+        rdma_reject(id, NULL, 0);
+        rdma_ack_cm_event(cm_event);
+        rdma_destroy_id(id);
         /* given that malloc failed this may also fail, but let's try */
         fprintf(stderr, "Failed to allocate memory for connection object\n");
         return ;
     }
 
-    LIBEVENT_THREAD *thread = cm_ctx->thread;
-
-    /* The four members are constant */
+    /* The four members are constant; transport tells a SIDR request apart */
     item->sfd = 0;  /* do not use */
     item->init_state = conn_new_cmd;
     item->event_flags = EV_READ | EV_PERSIST;
     item->read_buffer_size = DATA_BUFFER_SIZE;
-    item->transport = tcp_transport;
+    item->transport = RDMA_PS_UDP == id->ps ? udp_transport : tcp_transport;
 
-    item->cm_ctx = cm_ctx;
+    item->cm_id = id;
+    item->cm_usec = rdma_now_usec();
+    item->cm_param = cm_event->param.conn;
+    if (item->cm_param.private_data_len > RDMA_CM_PRIVATE_MAX) {
+        item->cm_param.private_data_len = RDMA_CM_PRIVATE_MAX;
+    }
+    if (item->cm_param.private_data) {
+        memcpy(item->cm_private, item->cm_param.private_data,
+               item->cm_param.private_data_len);
+        item->cm_param.private_data = item->cm_private;
+    }
+    rdma_ack_cm_event(cm_event);
 
+    if (0 != rdma_migrate_id(id, thread->cm_channel)) {
+        perror("rdma_migrate_id()");
+        rdma_reject(id, NULL, 0);
+        rdma_destroy_id(id);
+        cqi_free(item);
+        return;
+    }
+
+    /* counted now so the next placement already sees it */
+    if (!IS_UDP(item->transport)) {
+        __sync_add_and_fetch(&thread->load_conns, 1);
+    }
     cq_push(thread->new_conn_queue, item);
 
     MEMCACHED_CONN_DISPATCH(sfd, thread->thread_id);
@@ -894,30 +1249,46 @@ init_rdma_thread_resources(LIBEVENT_THREAD *me) {
         return -1;
     }
 
-    if ( !(me->comp_channel = ibv_create_comp_channel(rdma_context.device_ctx_used)) ) {
+    if ( !(me->comp_channel = ibv_create_comp_channel(me->device->verbs)) ) {
         perror("ibv_create_comp_channel()");
         return -1;
     }
-    me->ack_events = 0;
 
-    if ( !(me->pd = ibv_alloc_pd(rdma_context.device_ctx_used)) ) {
-        perror("ibv_alloc_pd()");
+    /* the conns this worker accepts are set up and torn down here */
+    if ( !(me->cm_channel = rdma_create_event_channel()) ) {
+        perror("rdma_create_event_channel()");
         return -1;
     }
-
-    struct ibv_srq_init_attr srq_init_attr;
-    srq_init_attr.srq_context = NULL;
-    srq_init_attr.attr.max_sge = 16;
-    srq_init_attr.attr.max_wr = rdma_context.srq_size;
-    srq_init_attr.attr.srq_limit = rdma_context.srq_size; /* RDMA TODO: what is srq_limit? */
-
-    if ( !(me->srq = ibv_create_srq(me->pd, &srq_init_attr)) ) {
-        perror("ibv_create_srq()");
+    int flags = fcntl(me->cm_channel->fd, F_GETFL);
+    if (flags < 0 || fcntl(me->cm_channel->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("setting O_NONBLOCK on the cm channel");
+        return -1;
+    }
+    event_set(&me->cm_event, me->cm_channel->fd, EV_READ | EV_PERSIST,
+            rdma_worker_cm_handler, me);
+    event_base_set(me->base, &me->cm_event);
+    if (event_add(&me->cm_event, 0) == -1) {
+        perror("event_add()");
+        return -1;
+    }
+    me->ack_events = 0;
+    pthread_mutex_init(&me->conn_pool_lock, NULL);
+    me->conn_pool = NULL;
+    me->conn_pool_count = 0;
+    me->cq_polling = false;
+    me->cq_last_usec = 0;
+    me->cq_gap_usec = 0;
+    me->cq_spins = 0;
+    me->ud = NULL;
+    me->cq_failed = false;
+
+    if ( !(me->pd = ibv_alloc_pd(me->device->verbs)) ) {
+        perror("ibv_alloc_pd()");
         return -1;
     }
 
-    if ( !(me->cq = ibv_create_cq(rdma_context.device_ctx_used, 
-                    rdma_context.cq_size, NULL, me->comp_channel, 0)) ) {
+    if ( !(me->cq = ibv_create_cq(me->device->verbs, 
+                    rdma_context.cq_size, me, me->comp_channel, 0)) ) {
         perror("ibv_create_cq()");
         return -1;
     }
@@ -928,8 +1299,6 @@ init_rdma_thread_resources(LIBEVENT_THREAD *me) {
     }
 
     if (settings.verbose > 0) {
-        printf("SRQ: max_wr: %d, max_sge: %d, srq_limit: %d.\n", srq_init_attr.attr.max_wr,
-                srq_init_attr.attr.max_sge, srq_init_attr.attr.srq_limit);
         printf("CQ: cq_size: %d.\n", me->cq->cqe);
     }
 
@@ -942,51 +1311,795 @@ init_rdma_thread_resources(LIBEVENT_THREAD *me) {
         return -1;
     }
 
-    me->rsize = rdma_context.buff_size;
-    me->rbuf_list = calloc(rdma_context.buff_per_thread, sizeof(char *));
-    me->rmr_list = calloc(rdma_context.buff_per_thread, sizeof(struct ibv_mr*));
-    me->rwr_list = calloc(rdma_context.buff_per_thread, sizeof(struct ibv_recv_wr));
-    me->rsglist = calloc(rdma_context.buff_per_thread, sizeof(struct ibv_sge));
     me->poll_wc = calloc(rdma_context.poll_wc_size, sizeof(struct ibv_wc));
+    me->send_chain = calloc(RDMA_SEND_WR / 2, sizeof(struct ibv_send_wr));
+    if (!me->poll_wc || !me->send_chain) {
+        fprintf(stderr, "out of memory in init_rdma_thread_resources()\n");
+        return -1;
+    }
+
+    if (0 != init_rdma_recv_class(me, RDMA_RECV_SMALL, rdma_context.recv_small_size,
+                rdma_context.recv_small_count)
+        || 0 != init_rdma_recv_class(me, RDMA_RECV_LARGE, rdma_context.buff_size,
+                rdma_context.buff_per_thread)
+        || 0 != init_rdma_recv_class(me, RDMA_RECV_UD, RDMA_UD_GRH + RDMA_UD_MAX_MSG,
+                rdma_context.ud_count)) {
+        fprintf(stderr, "init receive buffers error\n");
+        return -1;
+    }
+
+    if (0 != init_rdma_send_pool(me)) {
+        fprintf(stderr, "init send pool error\n");
+        return -1;
+    }
+
+    if (0 != init_rdma_send_arena(me)) {
+        fprintf(stderr, "init send arena error\n");
+        return -1;
+    }
+
+    evtimer_set(&me->qp_pool_event, rdma_qp_pool_refill, me);
+    event_base_set(me->base, &me->qp_pool_event);
+    me->qp_pool_pending = false;
+    while (rdma_qp_pool_fill(me)) {
+        continue;
+    }
+
+    if (rdma_context.arena_mr && 0 != init_rdma_arena_mr(me)) {
+        fprintf(stderr, "init arena mr error\n");
+        return -1;
+    }
+
+    if (rdma_context.rindex) {
+        /* the slots and the item copies behind them, nothing else */
+        if ( !(me->rindex_mr = ibv_reg_mr(me->pd, rdma_context.rindex,
+                        (sizeof(rdma_rindex_slot_t) + RDMA_RINDEX_DATA)
+                        << rdma_context.rindex_power,
+                        IBV_ACCESS_REMOTE_READ)) ) {
+            perror("ibv_reg_mr()");
+            return -1;
+        }
+    }
+
+    /* the devices' atomics were checked before the workers started */
+    if (rdma_context.counters) {
+        if ( !(me->counters_mr = ibv_reg_mr(me->pd, (void *)rdma_context.counters,
+                        sizeof(uint64_t) << rdma_context.counters_power,
+                        IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ
+                        | IBV_ACCESS_REMOTE_ATOMIC)) ) {
+            perror("ibv_reg_mr()");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/***************************************************************************//**
+ * receive buffer classes
+ *
+ * The buffers are registered one by one and posted to the class's own srq.
+ * A class without buffers has no srq and is never handed out. The srq is
+ * sized for the largest the class may grow to.
+ ******************************************************************************/
+static int
+init_rdma_recv_class(LIBEVENT_THREAD *me, int clsid, int size, int count) {
+    rdma_recv_class_t *cls = &me->recv_classes[clsid];
+    struct ibv_srq_init_attr srq_init_attr;
+
+    cls->size = size;
+    cls->count = 0;
+    cls->max_count = count * rdma_context.recv_growth;
+    cls->posted = 0;
+    cls->credits_out = 0;
+    cls->limit_hit = 0;
+    cls->nrepost = 0;
+    cls->srq = NULL;
+    cls->buf_list = NULL;
+    cls->mr_list = NULL;
+    cls->qp_pool = NULL;
+    cls->qp_pool_count = 0;
+    if (0 == count) {
+        return 0;
+    }
+
+    memset(&srq_init_attr, 0, sizeof(srq_init_attr));
+    srq_init_attr.srq_context = me;
+    srq_init_attr.attr.max_sge = 1;
+    srq_init_attr.attr.max_wr = cls->max_count;
+
+    if ( !(cls->srq = ibv_create_srq(me->pd, &srq_init_attr)) ) {
+        perror("ibv_create_srq()");
+        return -1;
+    }
+
+    if (0 != rdma_recv_class_grow(me, cls, count)) {
+        return -1;
+    }
+
+    if (settings.verbose > 0) {
+        printf("SRQ class %d: buffer size %d, buffers %d, up to %d.\n", clsid,
+                size, count, cls->max_count);
+    }
+
+    return 0;
+}
+
+/*
+ * Adds n buffers to a class, posts them in one chain and re-arms the srq
+ * limit for the new size. Buffers that could not be posted are freed, so
+ * the class only counts what the srq holds.
+ *
+ * Returns 0 if the class grew at all, -1 otherwise.
+ */
+static int
+rdma_recv_class_grow(LIBEVENT_THREAD *me, rdma_recv_class_t *cls, int n) {
+    struct ibv_recv_wr *wrs = NULL, *bad = NULL;
+    struct ibv_sge *sges = NULL;
     int i = 0;
-    for (i = 0; i < rdma_context.buff_per_thread; ++i) {
-        me->rbuf_list[i] = malloc(me->rsize);
-        if (me->rbuf_list[i] == 0) {
+
+    char **buf_list = realloc(cls->buf_list, (cls->count + n) * sizeof(char *));
+    if (buf_list) {
+        cls->buf_list = buf_list;
+    }
+    struct ibv_mr **mr_list = realloc(cls->mr_list, (cls->count + n) * sizeof(struct ibv_mr *));
+    if (mr_list) {
+        cls->mr_list = mr_list;
+    }
+    wrs = calloc(n, sizeof(struct ibv_recv_wr));
+    sges = calloc(n, sizeof(struct ibv_sge));
+    if (!buf_list || !mr_list || !wrs || !sges) {
+        fprintf(stderr, "out of memory growing receive buffers\n");
+        free(wrs);
+        free(sges);
+        return -1;
+    }
+
+    for (i = 0; i < n; ++i) {
+        char *buf = malloc(cls->size);
+        struct ibv_mr *mr = NULL;
+
+        if (!buf) {
+            fprintf(stderr, "out of memory growing receive buffers\n");
             break;
         }
+        if ( !(mr = ibv_reg_mr(me->pd, buf, cls->size, IBV_ACCESS_LOCAL_WRITE)) ) {
+            perror("ibv_reg_mr()");
+            free(buf);
+            break;
+        }
+        cls->buf_list[cls->count + i] = buf;
+        cls->mr_list[cls->count + i] = mr;
+
+        sges[i].addr = (uintptr_t)buf;
+        sges[i].length = cls->size;
+        sges[i].lkey = mr->lkey;
+        wrs[i].wr_id = (uintptr_t)mr;
+        wrs[i].sg_list = &sges[i];
+        wrs[i].num_sge = 1;
+        wrs[i].next = i + 1 < n ? &wrs[i + 1] : NULL;
     }
-    if (i != rdma_context.buff_per_thread) {
-        int j = 0;
-        for (j = 0; j < i; ++j) {
-            free(me->rbuf_list[j]);
+
+    n = i;
+    if (n > 0) {
+        wrs[n - 1].next = NULL;
+        if (0 != ibv_post_srq_recv(cls->srq, wrs, &bad)) {
+            /* the requests ahead of bad are posted, the rest are undone */
+            perror("ibv_post_srq_recv()");
+            for (i = bad ? (int)(bad - wrs) : 0; i < n; ++i) {
+                ibv_dereg_mr(cls->mr_list[cls->count + i]);
+                free(cls->buf_list[cls->count + i]);
+            }
+            n = bad ? (int)(bad - wrs) : 0;
         }
-        free(me->rbuf_list);
-        me->rbuf_list = 0;
+        cls->count += n;
+        __sync_add_and_fetch(&cls->posted, n);
     }
-    if (!me->rmr_list || !me->rbuf_list) {
-        fprintf(stderr, "out of memory in init_rdma_thread_resources()\n");
-        return -1;
+    free(wrs);
+    free(sges);
+
+    /* devices without srq limit support simply never raise the event */
+    struct ibv_srq_attr attr;
+    attr.srq_limit = cls->count / RDMA_SRQ_LIMIT_DIV;
+    if (attr.srq_limit > 0 && 0 != ibv_modify_srq(cls->srq, &attr, IBV_SRQ_LIMIT)) {
+        if (settings.verbose > 0) {
+            perror("ibv_modify_srq()");
+        }
+    }
+
+    return 0 == n ? -1 : 0;
+}
+
+/*
+ * Called on the dispatcher when one of the worker's srqs ran below its
+ * limit. The event is one-shot; the worker grows the class and re-arms it.
+ */
+void
+rdma_srq_limit_reached(LIBEVENT_THREAD *me, struct ibv_srq *srq) {
+    int i = 0;
+
+    for (i = 0; i < RDMA_RECV_CLASSES; ++i) {
+        if (me->recv_classes[i].srq == srq) {
+            __sync_lock_test_and_set(&me->recv_classes[i].limit_hit, 1);
+        }
     }
 
+    pthread_mutex_lock(&me->stats.mutex);
+    me->stats.rdma_srq_limit_events++;
+    pthread_mutex_unlock(&me->stats.mutex);
+
+    if (write(me->notify_send_fd, "r", 1) != 1) {
+        perror("Writing to thread notify pipe");
+    }
+}
+
+static void
+rdma_recv_replenish(LIBEVENT_THREAD *me) {
+    int i = 0, grown = 0, capped = 0;
+
+    rdma_flush_reposts(me);
+
+    for (i = 0; i < RDMA_RECV_CLASSES; ++i) {
+        rdma_recv_class_t *cls = &me->recv_classes[i];
+        if (!__sync_lock_test_and_set(&cls->limit_hit, 0)) {
+            continue;
+        }
+
+        int n = cls->max_count - cls->count;
+        if (n > cls->count) {
+            n = cls->count;
+        }
+        if (n <= 0) {
+            /* at the cap: just re-arm, the buffers come back as conns finish */
+            struct ibv_srq_attr attr;
+            attr.srq_limit = cls->count / RDMA_SRQ_LIMIT_DIV;
+            ibv_modify_srq(cls->srq, &attr, IBV_SRQ_LIMIT);
+            capped++;
+            continue;
+        }
+
+        int before = cls->count;
+        rdma_recv_class_grow(me, cls, n);
+        grown += cls->count - before;
+        if (settings.verbose > 0) {
+            fprintf(stderr, "SRQ class %d grown to %d buffers\n", i, cls->count);
+        }
+    }
+
+    pthread_mutex_lock(&me->stats.mutex);
+    me->stats.rdma_srq_grown += grown;
+    me->stats.rdma_srq_capped += capped;
+    pthread_mutex_unlock(&me->stats.mutex);
+}
+
+/*
+ * Posts the receives the worker queued since the last flush, one chain
+ * per class.
+ *
+ * Returns 0 on success, -1 if a chain was not fully posted; the receives
+ * from the failed one on stay queued for the next flush.
+ */
+int
+rdma_flush_reposts(LIBEVENT_THREAD *me) {
     struct ibv_recv_wr *bad = NULL;
-    for (i = 0; i < rdma_context.buff_per_thread; ++i) {
-        me->rmr_list[i] = ibv_reg_mr(me->pd, me->rbuf_list[i], me->rsize, IBV_ACCESS_LOCAL_WRITE);
+    int i = 0, j = 0, ret = 0;
 
-        me->rsglist[i].addr = (uintptr_t)me->rbuf_list[i];
-        me->rsglist[i].length = me->rsize;
-        me->rsglist[i].lkey = me->rmr_list[i]->lkey;
+    for (i = 0; i < RDMA_RECV_CLASSES; ++i) {
+        rdma_recv_class_t *cls = &me->recv_classes[i];
+        if (0 == cls->nrepost) {
+            continue;
+        }
 
-        me->rwr_list[i].wr_id = (uintptr_t)me->rmr_list[i];
-        me->rwr_list[i].next = NULL;
-        me->rwr_list[i].sg_list = &me->rsglist[i];
-        me->rwr_list[i].num_sge = 1;
+        for (j = 0; j < cls->nrepost; ++j) {
+            cls->repost_wr[j].sg_list = &cls->repost_sge[j];
+            cls->repost_wr[j].num_sge = 1;
+            cls->repost_wr[j].next = j + 1 < cls->nrepost ? &cls->repost_wr[j + 1] : NULL;
+        }
+        if (0 != ibv_post_srq_recv(cls->srq, cls->repost_wr, &bad)) {
+            /* the requests ahead of bad are posted, the rest stay queued */
+            int done = bad ? (int)(bad - cls->repost_wr) : 0;
 
-        if (0 != ibv_post_srq_recv(me->srq, &me->rwr_list[i], &bad)) {
             perror("ibv_post_srq_recv()");
+            ret = -1;
+            __sync_add_and_fetch(&cls->posted, done);
+            cls->nrepost -= done;
+            memmove(cls->repost_wr, cls->repost_wr + done,
+                    sizeof(*cls->repost_wr) * cls->nrepost);
+            memmove(cls->repost_sge, cls->repost_sge + done,
+                    sizeof(*cls->repost_sge) * cls->nrepost);
+        } else {
+            __sync_add_and_fetch(&cls->posted, cls->nrepost);
+            cls->nrepost = 0;
+        }
+    }
+    return ret;
+}
+
+
+/***************************************************************************//**
+ * pre-created qps
+ *
+ ******************************************************************************/
+
+/*
+ * An RC qp on the worker's cq and the class's srq, left in RESET. It asks
+ * for the inline size probed for the device at startup, stepping down
+ * further only if the provider still refuses it.
+ */
+struct ibv_qp *
+rdma_create_rc_qp(LIBEVENT_THREAD *me, rdma_recv_class_t *cls) {
+    struct ibv_qp_init_attr init_qp_attr;
+    rdma_device_t *dev = me->device;
+    int inline_size = dev->max_inline;
+    struct ibv_qp *qp = NULL;
+
+    memset(&init_qp_attr, 0, sizeof(init_qp_attr));
+    init_qp_attr.sq_sig_all = 0;
+    init_qp_attr.qp_type = IBV_QPT_RC;
+    init_qp_attr.send_cq = me->cq;
+    init_qp_attr.recv_cq = me->cq;
+    init_qp_attr.cap.max_send_wr = RDMA_SEND_WR;
+    init_qp_attr.cap.max_recv_wr = rdma_context.srq_size;
+    init_qp_attr.cap.max_send_sge = RDMA_MAX_SEND_SGE;
+    init_qp_attr.cap.max_recv_sge = 16;
+    init_qp_attr.srq = cls->srq;
+
+    for (;;) {
+        init_qp_attr.cap.max_inline_data = inline_size;
+        if ((qp = ibv_create_qp(me->pd, &init_qp_attr))) {
+            break;
+        }
+        if (0 == inline_size) {
+            perror("ibv_create_qp()");
+            return NULL;
+        }
+        inline_size /= 2;
+    }
+    return qp;
+}
+
+/*
+ * Adds up to RDMA_QP_POOL_BATCH qps to every class that is short.
+ *
+ * Returns true while some class is still short.
+ */
+static bool
+rdma_qp_pool_fill(LIBEVENT_THREAD *me) {
+    bool behind = false;
+    int i = 0, n = 0;
+
+    for (i = 0; i < RDMA_RECV_CLASSES; ++i) {
+        rdma_recv_class_t *cls = &me->recv_classes[i];
+        if (RDMA_RECV_UD == i || 0 == cls->count || 0 == rdma_context.qp_pool) {
+            continue;
+        }
+        if (!cls->qp_pool && !(cls->qp_pool = calloc(rdma_context.qp_pool, sizeof(struct ibv_qp *)))) {
+            continue;
+        }
+        for (n = 0; n < RDMA_QP_POOL_BATCH && cls->qp_pool_count < rdma_context.qp_pool; ++n) {
+            struct ibv_qp *qp = rdma_create_rc_qp(me, cls);
+            if (!qp) {
+                /* out of qps for now; connects create their own */
+                return false;
+            }
+            cls->qp_pool[cls->qp_pool_count++] = qp;
+        }
+        if (cls->qp_pool_count < rdma_context.qp_pool) {
+            behind = true;
+        }
+    }
+    return behind;
+}
+
+static void
+rdma_qp_pool_refill(int fd, short which, void *arg) {
+    LIBEVENT_THREAD *me = arg;
+    struct timeval tv = {0, 0};
+
+    if (rdma_qp_pool_fill(me)) {
+        evtimer_add(&me->qp_pool_event, &tv);
+        return;
+    }
+    me->qp_pool_pending = false;
+}
+
+/*
+ * A pre-created qp for a new conn of the class, or NULL if the pool is
+ * empty. Either way a refill is scheduled if it is short.
+ */
+struct ibv_qp *
+rdma_qp_pool_get(LIBEVENT_THREAD *me, rdma_recv_class_t *cls) {
+    struct ibv_qp *qp = NULL;
+    struct timeval tv = {0, 0};
+
+    if (cls->qp_pool_count > 0) {
+        qp = cls->qp_pool[--cls->qp_pool_count];
+    }
+    if (rdma_context.qp_pool > 0 && !me->qp_pool_pending) {
+        me->qp_pool_pending = true;
+        evtimer_add(&me->qp_pool_event, &tv);
+    }
+
+    pthread_mutex_lock(&me->stats.mutex);
+    if (qp) {
+        me->stats.rdma_qp_pool_hits++;
+    } else {
+        me->stats.rdma_qp_pool_misses++;
+    }
+    pthread_mutex_unlock(&me->stats.mutex);
+    return qp;
+}
+
+static int
+rdma_connect_bucket(uint64_t usec) {
+    int msb = 0, b = 0;
+
+    if (usec < 4) {
+        return (int)usec;
+    }
+    msb = 63 - __builtin_clzll(usec);
+    b = (msb - 1) * 4 + (int)((usec >> (msb - 2)) & 3);
+    return b < RDMA_CONNECT_HIST_BUCKETS ? b : RDMA_CONNECT_HIST_BUCKETS - 1;
+}
+
+/* the largest value that falls into bucket b */
+static uint64_t
+rdma_connect_bucket_max(int b) {
+    if (b < 4) {
+        return b;
+    }
+    return ((uint64_t)(4 + b % 4 + 1) << (b / 4 - 1)) - 1;
+}
+
+static void
+rdma_connect_sample(LIBEVENT_THREAD *me, uint64_t usec) {
+    pthread_mutex_lock(&me->stats.mutex);
+    me->stats.rdma_connect_hist[rdma_connect_bucket(usec)]++;
+    pthread_mutex_unlock(&me->stats.mutex);
+}
+
+/* connect latency in usec that a fraction q of the accepted conns stayed within */
+uint64_t
+rdma_connect_percentile(struct thread_stats *stats, double q) {
+    uint64_t total = 0, seen = 0, want = 0;
+    int b = 0;
+
+    for (b = 0; b < RDMA_CONNECT_HIST_BUCKETS; ++b) {
+        total += stats->rdma_connect_hist[b];
+    }
+    if (0 == total) {
+        return 0;
+    }
+    want = (uint64_t)(q * total);
+    if (want < 1) {
+        want = 1;
+    }
+    for (b = 0; b < RDMA_CONNECT_HIST_BUCKETS; ++b) {
+        seen += stats->rdma_connect_hist[b];
+        if (seen >= want) {
+            break;
+        }
+    }
+    return rdma_connect_bucket_max(b < RDMA_CONNECT_HIST_BUCKETS ? b : RDMA_CONNECT_HIST_BUCKETS - 1);
+}
+
+/***************************************************************************//**
+ * split the workers into one group per device
+ *
+ ******************************************************************************/
+static int
+rdma_device_numa_node(struct ibv_context *verbs) {
+    char path[sizeof(verbs->device->ibdev_path) + 32];
+    int node = -1;
+
+    snprintf(path, sizeof(path), "%s/device/numa_node", verbs->device->ibdev_path);
+    FILE *f = fopen(path, "r");
+    if (f) {
+        if (1 != fscanf(f, "%d", &node)) {
+            node = -1;
+        }
+        fclose(f);
+    }
+    return node;
+}
+
+static void
+init_rdma_device_groups(int nthreads) {
+    int i = 0, t = 0;
+
+    for (i = 0; i < rdma_context.ndevices; ++i) {
+        rdma_device_t *dev = &rdma_context.devices[i];
+
+        dev->first_thread = i * nthreads / rdma_context.ndevices;
+        dev->nthreads = (i + 1) * nthreads / rdma_context.ndevices - dev->first_thread;
+        dev->last_thread = -1;
+        dev->numa_node = rdma_device_numa_node(dev->verbs);
+
+        for (t = dev->first_thread; t < dev->first_thread + dev->nthreads; ++t) {
+            threads[t].device = dev;
+        }
+
+        if (settings.verbose > 0) {
+            fprintf(stderr, "RDMA device %s: numa node %d, threads %d-%d\n",
+                    ibv_get_device_name(dev->verbs->device), dev->numa_node,
+                    dev->first_thread, dev->first_thread + dev->nthreads - 1);
+        }
+    }
+}
+
+/* restrict the calling worker to the cpus of its device's node */
+static void
+rdma_bind_thread_node(LIBEVENT_THREAD *me) {
+#if defined(__linux__)
+    char path[64], buf[1024];
+    cpu_set_t set;
+
+    if (me->device->numa_node < 0) {
+        return;
+    }
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             me->device->numa_node);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return;
+    }
+    if (!fgets(buf, sizeof(buf), f)) {
+        fclose(f);
+        return;
+    }
+    fclose(f);
+
+    /* "0-7,16-23" */
+    CPU_ZERO(&set);
+    char *p = buf;
+    while (*p && *p != '\n') {
+        char *end = NULL;
+        long lo = strtol(p, &end, 10), hi = lo;
+        if (end == p) {
+            break;
+        }
+        if ('-' == *end) {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+        }
+        for (; lo <= hi && lo < CPU_SETSIZE; ++lo) {
+            CPU_SET(lo, &set);
+        }
+        p = (',' == *end) ? end + 1 : end;
+    }
+
+    if (CPU_COUNT(&set) > 0 &&
+        0 != pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+        perror("pthread_setaffinity_np()");
+    }
+#endif
+}
+
+/***************************************************************************//**
+ * init the pre-registered send pool
+ *
+ * Every class is one malloc'd slab registered once against the thread's pd,
+ * so the response path never has to call into the kernel to pin memory.
+ ******************************************************************************/
+static int
+init_rdma_send_pool(LIBEVENT_THREAD *me) {
+    rdma_send_pool_t *pool = &me->send_pool;
+    int i = 0, j = 0;
+
+    pthread_mutex_init(&pool->lock, NULL);
+
+    for (i = 0; i < RDMA_SEND_POOL_CLASSES; ++i) {
+        rdma_send_class_t *cls = &pool->classes[i];
+
+        cls->chunk_size = (size_t)RDMA_SEND_POOL_MIN_CHUNK << (2 * i);
+        cls->nchunks = rdma_context.send_pool_size / cls->chunk_size;
+        if (cls->nchunks < 1) {
+            cls->nchunks = 1;
+        }
+
+        cls->base = malloc(cls->chunk_size * cls->nchunks);
+        cls->chunks = calloc(cls->nchunks, sizeof(rdma_sbuf_t));
+        if (!cls->base || !cls->chunks) {
+            fprintf(stderr, "out of memory in init_rdma_send_pool()\n");
             return -1;
         }
+
+        if ( !(cls->mr = ibv_reg_mr(me->pd, cls->base,
+                        cls->chunk_size * cls->nchunks, IBV_ACCESS_LOCAL_WRITE)) ) {
+            perror("ibv_reg_mr()");
+            return -1;
+        }
+
+        cls->free_list = NULL;
+        for (j = cls->nchunks - 1; j >= 0; --j) {
+            rdma_sbuf_t *sbuf = &cls->chunks[j];
+            sbuf->buf = cls->base + cls->chunk_size * j;
+            sbuf->lkey = cls->mr->lkey;
+            sbuf->clsid = i;
+            sbuf->next = cls->free_list;
+            cls->free_list = sbuf;
+        }
+
+        if (settings.verbose > 0) {
+            printf("send pool class %d: chunk size %lu, chunks %d.\n", i,
+                    (unsigned long)cls->chunk_size, cls->nchunks);
+        }
     }
 
     return 0;
 }
 
+/*
+ * Returns a registered chunk large enough for len bytes, or NULL if the
+ * fragment is too large or its class and the next one up are exhausted.
+ * Falling through further would spend 16x the fragment or more.
+ */
+rdma_sbuf_t *
+rdma_send_pool_get(LIBEVENT_THREAD *me, size_t len) {
+    rdma_send_pool_t *pool = &me->send_pool;
+    rdma_sbuf_t *sbuf = NULL;
+    int i = 0;
+    int last = 0;
+
+    while (i < RDMA_SEND_POOL_CLASSES && pool->classes[i].chunk_size < len) {
+        ++i;
+    }
+    last = i + 1;
+
+    pthread_mutex_lock(&pool->lock);
+    for (; i <= last && i < RDMA_SEND_POOL_CLASSES; ++i) {
+        rdma_send_class_t *cls = &pool->classes[i];
+        if (cls->free_list) {
+            sbuf = cls->free_list;
+            cls->free_list = sbuf->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return sbuf;
+}
+
+void
+rdma_send_pool_put(LIBEVENT_THREAD *me, rdma_sbuf_t *sbuf) {
+    rdma_send_class_t *cls = &me->send_pool.classes[sbuf->clsid];
+
+    pthread_mutex_lock(&me->send_pool.lock);
+    sbuf->next = cls->free_list;
+    cls->free_list = sbuf;
+    pthread_mutex_unlock(&me->send_pool.lock);
+}
+
+/***************************************************************************//**
+ * init the send arena
+ *
+ * One registered slab shared by all conns of the thread, carved into
+ * RDMA_ARENA_CHUNK byte chunks that conns stage their replies in.
+ ******************************************************************************/
+static int
+init_rdma_send_arena(LIBEVENT_THREAD *me) {
+    rdma_send_arena_t *arena = &me->send_arena;
+    int i = 0;
+
+    pthread_mutex_init(&arena->lock, NULL);
+
+    arena->nchunks = rdma_context.send_arena_size / RDMA_ARENA_CHUNK;
+    if (arena->nchunks < 1) {
+        arena->nchunks = 1;
+    }
+
+    arena->base = malloc((size_t)RDMA_ARENA_CHUNK * arena->nchunks);
+    arena->chunks = calloc(arena->nchunks, sizeof(rdma_sbuf_t));
+    if (!arena->base || !arena->chunks) {
+        fprintf(stderr, "out of memory in init_rdma_send_arena()\n");
+        return -1;
+    }
+
+    if ( !(arena->mr = ibv_reg_mr(me->pd, arena->base,
+                    (size_t)RDMA_ARENA_CHUNK * arena->nchunks, IBV_ACCESS_LOCAL_WRITE)) ) {
+        perror("ibv_reg_mr()");
+        return -1;
+    }
+
+    arena->free_list = NULL;
+    for (i = arena->nchunks - 1; i >= 0; --i) {
+        rdma_sbuf_t *chunk = &arena->chunks[i];
+        chunk->buf = arena->base + (size_t)RDMA_ARENA_CHUNK * i;
+        chunk->lkey = arena->mr->lkey;
+        chunk->clsid = -1;
+        chunk->next = arena->free_list;
+        arena->free_list = chunk;
+    }
+    arena->nfree = arena->nchunks;
+
+    if (settings.verbose > 0) {
+        printf("send arena: chunk size %d, chunks %d.\n", RDMA_ARENA_CHUNK, arena->nchunks);
+    }
+
+    return 0;
+}
+
+/*
+ * Returns a free arena chunk, or NULL if every chunk is held by a conn.
+ */
+rdma_sbuf_t *
+rdma_send_arena_get(LIBEVENT_THREAD *me) {
+    rdma_send_arena_t *arena = &me->send_arena;
+    rdma_sbuf_t *chunk = NULL;
+
+    pthread_mutex_lock(&arena->lock);
+    if ((chunk = arena->free_list)) {
+        arena->free_list = chunk->next;
+        arena->nfree--;
+    }
+    pthread_mutex_unlock(&arena->lock);
+
+    return chunk;
+}
+
+void
+rdma_send_arena_put(LIBEVENT_THREAD *me, rdma_sbuf_t *chunk) {
+    rdma_send_arena_t *arena = &me->send_arena;
+
+    pthread_mutex_lock(&arena->lock);
+    chunk->next = arena->free_list;
+    arena->free_list = chunk;
+    arena->nfree++;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/***************************************************************************//**
+ * register the item arena against the thread's pd
+ *
+ * The slab allocator does not expose its arena, so the whole address space
+ * is registered as one implicit on-demand-paging MR. Nothing is pinned up
+ * front; pages are faulted into the NIC's tables the first time they are
+ * sent, after which GET responses can point straight at ITEM_data().
+ ******************************************************************************/
+static int
+init_rdma_arena_mr(LIBEVENT_THREAD *me) {
+    struct ibv_device_attr_ex attr;
+    struct timeval begin, end;
+
+    memset(&attr, 0, sizeof(attr));
+    if (0 != ibv_query_device_ex(me->device->verbs, NULL, &attr)) {
+        perror("ibv_query_device_ex()");
+        return -1;
+    }
+
+    if (!(attr.odp_caps.general_caps & IBV_ODP_SUPPORT_IMPLICIT) ||
+        !(attr.odp_caps.per_transport_caps.rc_odp_caps & IBV_ODP_SUPPORT_SEND)) {
+        fprintf(stderr, "device has no implicit ODP support, "
+                "falling back to the send pool\n");
+        me->arena_mr = NULL;
+        me->arena_reads = false;
+        return 0;
+    }
+
+    /* SET values can then be read straight into their items as well */
+    me->arena_reads = 0 != (attr.odp_caps.per_transport_caps.rc_odp_caps & IBV_ODP_SUPPORT_READ);
+
+    /* local only: it covers the whole address space */
+    int access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_ON_DEMAND;
+
+    gettimeofday(&begin, NULL);
+    if ( !(me->arena_mr = ibv_reg_mr(me->pd, NULL, SIZE_MAX, access)) ) {
+        perror("ibv_reg_mr()");
+        return -1;
+    }
+    gettimeofday(&end, NULL);
+
+    STATS_LOCK();
+    stats.rdma_arena_reg_usec += (end.tv_sec - begin.tv_sec) * 1000000
+                                 + (end.tv_usec - begin.tv_usec);
+    STATS_UNLOCK();
+
+    if (settings.verbose > 0) {
+        printf("arena mr: lkey %u, registered in %ld usec, 0 bytes pinned.\n",
+                me->arena_mr->lkey, (long)((end.tv_sec - begin.tv_sec) * 1000000
+                                 + (end.tv_usec - begin.tv_usec)));
+    }
+
+    return 0;
+}